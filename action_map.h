@@ -1,23 +1,26 @@
 #pragma once
 
+#include "executor.h"
 #include "lock.h"
 
 #include <map>
-#include <functional>
 #include <array>
+#include <vector>
 
 namespace bus::internal {
 
 class ActionMap {
 private:
     static constexpr size_t kSmallThreshold = 20;
+    // erased nodes of map_ kept for reuse, so steady scheduling does not allocate them
+    static constexpr size_t kMaxSpareNodes = 64;
 
 public:
-    using time_point = std::chrono::system_clock::time_point;
+    using time_point = Clock::time_point;
 
     ActionMap() = default;
 
-    void insert(time_point pt, std::function<void()> action) {
+    void insert(time_point pt, Task action) {
         min_pt_ = std::min(min_pt_.value_or(time_point::max()), pt);
         if (map_.empty()) {
             for (size_t i = 0; i < small_map_.size(); ++i) {
@@ -28,14 +31,22 @@ public:
                 }
             }
         }
-        map_.insert( { pt, std::move(action) } );
+        if (spare_nodes_.empty()) {
+            map_.insert( { pt, std::move(action) } );
+        } else {
+            auto node = std::move(spare_nodes_.back());
+            spare_nodes_.pop_back();
+            node.key() = pt;
+            node.mapped() = std::move(action);
+            map_.insert(std::move(node));
+        }
     }
 
     std::optional<time_point> next_time_point() {
         return min_pt_;
     }
 
-    std::function<void()> pick_action() {
+    Task pick_action() {
         if (!small_map_empty_) {
             std::pair<time_point, size_t> small_min = { time_point::max(), small_map_.size() };
             for (size_t i = 0; i < small_map_.size(); ++i) {
@@ -48,7 +59,7 @@ public:
                 big_min = map_.begin()->first;
             }
             if (small_min.second < small_map_.size() && big_min > small_min.first) {
-                std::function<void()> result = std::move(small_map_[small_min.second].second);
+                Task result = std::move(small_map_[small_min.second].second);
                 small_map_[small_min.second].second = {};
                 recalc_min();
                 return result;
@@ -58,8 +69,14 @@ public:
             return {};
         } else {
             auto it = map_.begin();
-            std::function<void()> result = std::move(it->second);
-            map_.erase(it);
+            Task result = std::move(it->second);
+            if (spare_nodes_.size() < kMaxSpareNodes) {
+                auto node = map_.extract(it);
+                node.mapped() = nullptr;
+                spare_nodes_.push_back(std::move(node));
+            } else {
+                map_.erase(it);
+            }
             recalc_min();
             return result;
         }
@@ -83,8 +100,11 @@ private:
     }
 
 private:
-    std::multimap<time_point, std::function<void()>> map_;
-    std::array<std::pair<time_point, std::function<void()>>, kSmallThreshold> small_map_;
+    using Map = std::multimap<time_point, Task>;
+
+    Map map_;
+    std::vector<Map::node_type> spare_nodes_;
+    std::array<std::pair<time_point, Task>, kSmallThreshold> small_map_;
     bool small_map_empty_ = true;
 
     std::optional<time_point> min_pt_;
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include <netinet/in.h>
+
+namespace bus::internal {
+
+struct AddressHash {
+    size_t operator () (const sockaddr_in6& addr) const {
+        std::string_view view(reinterpret_cast<const char*>(&addr), sizeof(addr));
+        return std::hash<std::string_view>()(view);
+    }
+};
+
+// open addressed map from v6 address to endpoint with linear probing.
+// Erase shifts the rest of the probe run back, so there are no tombstones
+template<typename Hash = AddressHash>
+class AddressMap {
+public:
+    std::optional<int> find(const sockaddr_in6& addr) const {
+        if (auto i = position(addr)) {
+            return slots_[*i].endpoint;
+        }
+        return std::nullopt;
+    }
+
+    // endpoint is non negative
+    void insert_or_assign(const sockaddr_in6& addr, int endpoint) {
+        if (2 * (size_ + 1) > slots_.size()) {
+            rehash(std::max<size_t>(16, 2 * slots_.size()));
+        }
+        size_t i = home(addr);
+        while (slots_[i].endpoint != kEmpty && memcmp(&slots_[i].addr, &addr, sizeof(addr)) != 0) {
+            i = next(i);
+        }
+        size_ += slots_[i].endpoint == kEmpty;
+        slots_[i] = Slot{ .addr = addr, .endpoint = endpoint };
+    }
+
+    bool erase(const sockaddr_in6& addr) {
+        auto found = position(addr);
+        if (!found) {
+            return false;
+        }
+        size_t hole = *found;
+        for (size_t i = next(hole); slots_[i].endpoint != kEmpty; i = next(i)) {
+            // slot may fill the hole unless the hole lies before its home position
+            size_t mask = slots_.size() - 1;
+            if (((i - home(slots_[i].addr)) & mask) >= ((i - hole) & mask)) {
+                slots_[hole] = slots_[i];
+                hole = i;
+            }
+        }
+        slots_[hole].endpoint = kEmpty;
+        --size_;
+        return true;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    static constexpr int kEmpty = -1;
+
+    struct Slot {
+        sockaddr_in6 addr;
+        int endpoint = kEmpty;
+    };
+
+private:
+    size_t home(const sockaddr_in6& addr) const {
+        return Hash()(addr) & (slots_.size() - 1);
+    }
+
+    size_t next(size_t i) const {
+        return (i + 1) & (slots_.size() - 1);
+    }
+
+    std::optional<size_t> position(const sockaddr_in6& addr) const {
+        if (slots_.empty()) {
+            return std::nullopt;
+        }
+        for (size_t i = home(addr);; i = next(i)) {
+            if (slots_[i].endpoint == kEmpty) {
+                return std::nullopt;
+            }
+            if (memcmp(&slots_[i].addr, &addr, sizeof(addr)) == 0) {
+                return i;
+            }
+        }
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> slots(capacity);
+        std::swap(slots, slots_);
+        size_ = 0;
+        for (auto& slot : slots) {
+            if (slot.endpoint != kEmpty) {
+                insert_or_assign(slot.addr, slot.endpoint);
+            }
+        }
+    }
+
+private:
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+};
+
+}
@@ -0,0 +1,93 @@
+#include "proto_bus.h"
+#include "messages.pb.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <vector>
+
+using namespace bus;
+
+// heap allocations of the whole process, every thread included
+std::atomic<uint64_t> allocations = 0;
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+// fails once steady state rpc allocates more than this, update it along with the hot path.
+// What is left per rpc: strings of the request parsed by the handler side and of the response
+// parsed by the caller (4), timer nodes when pending timeouts outnumber the spare ones (~0.03)
+constexpr double kMaxAllocationsPerRpc = 4.2;
+
+class EchoService: public ProtoBus {
+public:
+    EchoService(EndpointManager& manager, int port)
+        : ProtoBus({.tcp_opts={.port=port, .fixed_pool_size=1}}, manager)
+    {
+        register_handler<Operation, Operation>(1, [](int, Operation op) -> Future<Operation> {
+            return make_future(std::move(op));
+        });
+        ProtoBus::start();
+    }
+};
+
+int main() {
+    EndpointManager manager;
+    EchoService client(manager, 4101);
+    EchoService server(manager, 4102);
+    int endpoint = manager.register_endpoint("::1", 4102);
+
+    constexpr size_t rpcs = 20000;
+    // requests are made before counting starts and moved into send, only the bus allocates
+    Operation op;
+    op.set_key("key");
+    op.set_value("value");
+    std::vector<Operation> ops(rpcs, op);
+
+    // short timeout, so that timers of finished rpcs fire and their nodes are reused within warm up
+    constexpr auto timeout = std::chrono::milliseconds(200);
+    auto rpc = [&] (Operation op) {
+        auto future = client.send<Operation, Operation>(std::move(op), endpoint, 1, timeout);
+        if (auto& result = future.wait(); !result) {
+            std::cerr << "rpc failed: " << result.what() << std::endl;
+            exit(1);
+        }
+    };
+
+    // connections, pools and timer storage reach their steady size
+    for (auto start = std::chrono::steady_clock::now(); std::chrono::steady_clock::now() - start < 3 * timeout;) {
+        rpc(op);
+    }
+
+    uint64_t before = allocations.load();
+    auto pt = std::chrono::steady_clock::now();
+    for (auto& op : ops) {
+        rpc(std::move(op));
+    }
+    auto elapsed = std::chrono::steady_clock::now() - pt;
+    double per_rpc = static_cast<double>(allocations.load() - before) / rpcs;
+
+    std::cerr << "allocations per rpc " << per_rpc << ", "
+        << std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / rpcs << " ns per rpc" << std::endl;
+    if (per_rpc > kMaxAllocationsPerRpc) {
+        std::cerr << "allocations regressed, budget is " << kMaxAllocationsPerRpc << std::endl;
+        return 1;
+    }
+    // buses are left running, process exits with their threads
+    std::_Exit(0);
+}
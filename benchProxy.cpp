@@ -1,12 +1,37 @@
 #include "bus.h"
+#include "checksum.h"
 #include "messages.pb.h"
 
 #include <chrono>
+#include <cstring>
 #include <thread>
 
 using namespace bus;
 
-int main() {
+// bytes per second of crc32c over 4k buffers
+template <class Crc>
+double checksum_throughput(Crc crc) {
+    std::vector<char> data(4096, 'x');
+    size_t rounds = 100000;
+    uint32_t result = 0;
+    auto pt = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; ++i) {
+        result = crc(data.data(), data.size(), result);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - pt;
+    // keeps the loop from being optimized out
+    data[0] = result;
+    return rounds * data.size() / elapsed.count();
+}
+
+// --checksums turns on frame checksums, to compare throughput with and without them
+int main(int argc, char** argv) {
+    bool checksums = argc > 1 && strcmp(argv[1], "--checksums") == 0;
+    if (checksums) {
+        std::cerr << "crc32c " << checksum_throughput(internal::crc32c) / 1e9 << " GB/s, portable "
+            << checksum_throughput(internal::crc32c_portable) / 1e9 << " GB/s" << std::endl;
+    }
+
     EndpointManager manager;
     int backend_endpoint = manager.register_endpoint("::1", 4001);
     int proxy_endpoint = manager.register_endpoint("::1", 4002);
@@ -14,7 +39,7 @@ int main() {
 
     std::thread backend([&] {
             BufferPool bufferPool{4098};
-            TcpBus bus(TcpBus::Options{.port = 4001, .fixed_pool_size = 7}, bufferPool, manager);
+            TcpBus bus(TcpBus::Options{.port = 4001, .fixed_pool_size = 7, .frame_checksums = checksums}, bufferPool, manager);
             bus.start([&](auto handle, auto blob) {
                     Operation op;
                     op.set_key("answer");
@@ -29,7 +54,7 @@ int main() {
 
     std::thread proxy([&] {
             BufferPool bufferPool{4098};
-            TcpBus bus(TcpBus::Options{.port = 4002, .fixed_pool_size = 7}, bufferPool, manager);
+            TcpBus bus(TcpBus::Options{.port = 4002, .fixed_pool_size = 7, .frame_checksums = checksums}, bufferPool, manager);
             bus.start([&](auto handle, auto blob) {
                     Operation op;
                     op.ParseFromArray(blob.data(), blob.size());
@@ -46,7 +71,7 @@ int main() {
     std::atomic<size_t> messages_received = 0;
 
     BufferPool bufferPool{4098};
-    TcpBus bus(TcpBus::Options{.port = 4003, .fixed_pool_size = 7}, bufferPool, manager);
+    TcpBus bus(TcpBus::Options{.port = 4003, .fixed_pool_size = 7, .frame_checksums = checksums}, bufferPool, manager);
     std::thread client([&] {
             bus.start([&](auto handle, auto blob) {
                     messages_received.fetch_add(1);
@@ -0,0 +1,41 @@
+#include "buffer.h"
+
+#include "error.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bus {
+
+MappedFile::MappedFile(int fd)
+    : fd_(fd)
+{
+    auto fail = [this] {
+        int error = errno;
+        ::close(fd_);
+        errno = error;
+        throw_errno();
+    };
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        fail();
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (data == MAP_FAILED) {
+            fail();
+        }
+        data_ = static_cast<char*>(data);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        munmap(data_, size_);
+    }
+    ::close(fd_);
+}
+
+}
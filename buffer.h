@@ -45,7 +45,10 @@ public:
     DataPtr take(size_t size) {
         if (auto result = try_fetch(size, head_.load())) {
             return result;
-        } else {
+        }
+        DataPtr result;
+        Buffer* old_head;
+        {
             auto state = state_.get();
             Buffer* new_buffer;
             if (state->free_.empty()) {
@@ -63,14 +66,17 @@ public:
             new_buffer->offset.store(0);
 
             result = try_fetch(size, new_buffer);
-            head_.store(state->buffers_.back().get());
+            // pool holds head buffer till it's exhausted, otherwise buffer would be freed
+            // while it still serves allocations
+            new_buffer->usage_counter.fetch_add(1);
+            old_head = head_.exchange(new_buffer);
+        }
+        put({ .buffer = old_head });
 
-            if (!result) {
-                throw std::runtime_error("bad buffer alloc");
-            } else {
-                return result;
-            }
+        if (!result) {
+            throw std::runtime_error("bad buffer alloc");
         }
+        return result;
     }
 
     void put(DataPtr ptr) {
@@ -107,10 +113,45 @@ private:
     std::atomic<Buffer*> head_ = nullptr;
 };
 
+// read only mapping of a whole file, owns the fd
+class MappedFile {
+public:
+    explicit MappedFile(int fd);
+
+    MappedFile(const MappedFile&) = delete;
+
+    int fd() const {
+        return fd_;
+    }
+
+    char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    ~MappedFile();
+
+private:
+    int fd_;
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
 class SharedView {
 public:
     SharedView() = default;
 
+    // file backed view, data() is read only. TcpBus sends it with sendfile, bypassing buffer pool
+    SharedView(std::shared_ptr<const MappedFile> file, size_t offset, size_t size)
+        : file_(std::move(file))
+        , data_(file_->data() + offset)
+        , size_(size)
+    {
+    }
+
     SharedView(BufferPool& pool, size_t size)
         : pool_(&pool)
         , ptr_(pool.take(size))
@@ -131,7 +172,7 @@ public:
         ref();
     }
 
-    SharedView(SharedView&& oth) {
+    SharedView(SharedView&& oth) noexcept {
         mem_swap(oth);
     }
 
@@ -140,7 +181,16 @@ public:
     }
 
     bool initialized() {
-        return pool_;
+        return pool_ || file_;
+    }
+
+    const MappedFile* file() const {
+        return file_.get();
+    }
+
+    // offset of data() in file
+    size_t file_offset() const {
+        return data_ - file_->data();
     }
 
     SharedView slice(size_t start, size_t size) const {
@@ -173,6 +223,7 @@ public:
 private:
     void mem_reset() {
         pool_ = nullptr;
+        file_.reset();
         ptr_ = {};
         size_ = 0;
     }
@@ -190,12 +241,13 @@ private:
     }
 
     void mem_copy(const SharedView& oth) {
-        std::tie(pool_, ptr_, data_, size_) = std::tie(oth.pool_, oth.ptr_, oth.data_, oth.size_);
+        std::tie(pool_, ptr_, file_, data_, size_) = std::tie(oth.pool_, oth.ptr_, oth.file_, oth.data_, oth.size_);
     }
 
     void mem_swap(SharedView& view) {
         std::swap(pool_, view.pool_);
         std::swap(ptr_, view.ptr_);
+        std::swap(file_, view.file_);
         std::swap(data_, view.data_);
         std::swap(size_, view.size_);
     }
@@ -203,6 +255,7 @@ private:
 private:
     BufferPool* pool_ = nullptr;
     BufferPool::DataPtr ptr_;
+    std::shared_ptr<const MappedFile> file_;
     char* data_ = nullptr;
     size_t size_ = 0;
 };
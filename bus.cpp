@@ -2,6 +2,11 @@
 #include "util.h"
 #include "lock.h"
 #include "action_map.h"
+#include "metrics.h"
+#include "trace.h"
+#include "checksum.h"
+#include "datagram_socket.h"
+#include "ring_deque.h"
 
 #include "error.h"
 
@@ -15,28 +20,85 @@
 #include <sys/eventfd.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
 #include <netinet/tcp.h>
+#include <linux/errqueue.h>
 #include <unistd.h>
 
+#include <deque>
 #include <functional>
+#include <random>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
-#include <queue>
 
 namespace bus {
 
+struct EndpointMetrics {
+    EndpointMetrics(Metrics& metrics, int endpoint)
+        : bytes_in(metrics.counter("tcp.bytes_in", endpoint))
+        , bytes_out(metrics.counter("tcp.bytes_out", endpoint))
+        , messages_in(metrics.counter("tcp.messages_in", endpoint))
+        , messages_out(metrics.counter("tcp.messages_out", endpoint))
+        , queue_depth(metrics.gauge("tcp.queue_depth", endpoint))
+    {
+    }
+
+    internal::Counter& bytes_in;
+    internal::Counter& bytes_out;
+    internal::Counter& messages_in;
+    internal::Counter& messages_out;
+    internal::Gauge& queue_depth;
+};
+
 class TcpBus::Impl {
 public:
+    struct QueuedMessage {
+        SharedView message;
+        uint64_t trace_id;
+        // max if there is none
+        Clock::time_point deadline = Clock::time_point::max();
+    };
+
+    struct PendingQueue {
+        internal::RingDeque<QueuedMessage> messages;
+        // payload size of queued messages
+        size_t bytes = 0;
+        // of its endpoint, filled in on first use
+        EndpointMetrics* metrics = nullptr;
+        // since when queue is deep enough to grow the pool, max if it isn't
+        Clock::time_point deep_since = Clock::time_point::max();
+    };
+
     Impl(bus::TcpBus::Options opts, BufferPool& buffer_pool, EndpointManager& endpoint_manager)
         : fixed_pool_size_(opts.fixed_pool_size)
         , port_(opts.port)
+        , unix_path_(opts.unix_path)
+        , shm_ring_size_(opts.shm_ring_size)
+        , local_delivery_(opts.local_delivery)
+        , zerocopy_threshold_(opts.zerocopy_threshold)
+        , busy_poll_(opts.busy_poll)
+        , loop_cpu_(opts.loop_cpu)
+        , timer_slack_(opts.timer_slack)
+        , default_pool_policy_(opts.pool_policy)
+        , connect_timeout_(opts.connect_timeout)
+        , reconnect_backoff_(opts.reconnect_backoff)
+        , max_reconnect_backoff_(opts.max_reconnect_backoff)
+        , connection_budget_(opts.connection_budget ? opts.connection_budget : default_connection_budget())
         , listener_backlog_(opts.listener_backlog)
         , buffer_pool_(buffer_pool)
         , endpoint_manager_(endpoint_manager)
         , max_message_size_(opts.max_message_size)
         , max_pending_messages_(opts.max_pending_messages)
+        , max_pending_bytes_(opts.max_pending_bytes)
+        , frame_checksums_(opts.frame_checksums)
+        , datagrams_(opts.datagrams)
+        , max_pending_datagrams_(opts.max_pending_datagrams)
+        , max_connection_inflight_bytes_(opts.max_connection_inflight_bytes)
+        , max_inflight_bytes_(opts.max_inflight_bytes)
+        , metrics_(metrics_registry_)
     {
         epollfd_ = epoll_create1(EPOLL_CLOEXEC);
         CHECK_ERRNO(epollfd_ >= 0);
@@ -48,6 +110,7 @@ public:
         CHECK_ERRNO(timerfd_ >= 0);
 
         listen_id_ = pool_.make_id();
+        unix_listen_id_ = pool_.make_id();
 
         auto add_lt = [&] (int fd, size_t& id) {
             epoll_event evt;
@@ -59,11 +122,20 @@ public:
         add_lt(breakfd_, break_id_);
         add_lt(timerfd_, timer_id_);
         add_lt(timerctlfd_, timerctl_id_);
+
+        resolved_subscription_ = endpoint_manager_.subscribe_resolved([this] (int endpoint) {
+                local_routes_.get()->erase(endpoint);
+                schedule_local([this, endpoint] { fix_pool_size(endpoint); });
+            });
     }
 
     void start(std::function<void(ConnHandle, SharedView)> handler) {
         handler_ = std::move(handler);
 
+        if (default_pool_policy_) {
+            enable_autoscaling();
+        }
+
         listensock_ = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
                              IPPROTO_TCP);
         CHECK_ERRNO(listensock_ >= 0);
@@ -88,56 +160,415 @@ public:
             evt.data.u64 = listen_id_;
             CHECK_ERRNO(epoll_ctl(epollfd_, EPOLL_CTL_ADD, listensock_, &evt) == 0);
         }
+
+        if (datagrams_) {
+            datagram_socket_ = std::make_unique<DatagramSocket>(endpoint_manager_.listen_datagram(port_));
+            datagram_id_ = epoll_add(datagram_socket_->fd(), pool_.make_id());
+        }
+
+        if (unix_path_) {
+            unix_listensock_ = endpoint_manager_.listen_unix(*unix_path_, listener_backlog_);
+            epoll_event evt;
+            evt.events = EPOLLIN;
+            evt.data.u64 = unix_listen_id_;
+            CHECK_ERRNO(epoll_ctl(epollfd_, EPOLL_CTL_ADD, unix_listensock_.get(), &evt) == 0);
+        }
+
+        if (local_delivery_) {
+            auto buses = local_buses().get();
+            (*buses)["tcp:" + std::to_string(port_)] = this;
+            if (unix_path_) {
+                (*buses)["unix:" + *unix_path_] = this;
+            }
+        }
     }
 
     ~Impl() {
+        endpoint_manager_.unsubscribe_resolved(resolved_subscription_);
+        for (auto& [id, data] : zerocopy_lingering_) {
+            data->socket.set_graceful_close(false);
+        }
+        if (local_delivery_) {
+            auto buses = local_buses().get();
+            for (auto it = buses->begin(); it != buses->end();) {
+                if (it->second == this) {
+                    it = buses->erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
         ::close(listensock_);
         ::close(epollfd_);
+        if (unix_path_ && unix_listensock_.get() >= 0) {
+            unlink(unix_path_->c_str());
+        }
     }
 
-    void accept_conns() {
+    void accept_conns(int listensock) {
         for (size_t i = 0; i < 2; ++i) {
-            EndpointManager::IncomingConnection conn = endpoint_manager_.accept(listensock_);
+            EndpointManager::IncomingConnection conn = endpoint_manager_.accept(listensock);
             if (conn.sock_.get() >= 0) {
                 uint64_t id = pool_.make_id();
                 auto data = pool_.add(conn.sock_.release(), id, conn.endpoint_);
+                data->accepts_shm_offer = (listensock == unix_listensock_.get());
+                if (listensock == listensock_) {
+                    setup_tcp_socket(data.get());
+                }
 
                 epoll_add(data->socket.get(), id);
                 pool_.set_available(id);
+                metrics_.accepts.add();
+                check_budget();
             } else if (conn.errno_ == EAGAIN) {
                 return;
             } else  if (conn.errno_ == EMFILE || conn.errno_ == ENFILE || conn.errno_ == ENOBUFS || conn.errno_ == ENOMEM) {
-                pool_.close_old_conns(2);
+                metrics_.fd_exhausted.add();
+                if (!free_fds()) {
+                    pause_accepting(listensock, listensock == listensock_ ? listen_id_ : unix_listen_id_);
+                }
+                return;
             } else if (conn.errno_ != EINTR) {
                 throw_errno();
             }
         }
     }
 
+    std::optional<PoolPolicy> pool_policy(int endpoint) {
+        auto overrides = pool_overrides_.get();
+        if (auto it = overrides->find(endpoint); it != overrides->end()) {
+            return it->second;
+        }
+        return default_pool_policy_;
+    }
+
     void fix_pool_size(int endpoint) {
-        if (endpoint_manager_.transient(endpoint)) {
+        // unresolved endpoint is connected once resolver notifies us
+        if (endpoint_manager_.transient(endpoint) || !endpoint_manager_.resolved(endpoint)) {
+            return;
+        }
+        auto policy = pool_policy(endpoint);
+        size_t target = policy ? policy->min_connections : fixed_pool_size_;
+        {
+            auto reconnect = reconnect_.get();
+            if (auto it = reconnect->find(endpoint); it != reconnect->end()) {
+                if (Clock::now() < it->second.retry_at) {
+                    return;
+                }
+                // single probe connection till endpoint is up again
+                target = 1;
+            }
+        }
+        for (size_t pool_size = pool_.count_connections(endpoint); pool_size < target; ++pool_size) {
+            if (!connect(endpoint)) {
+                return;
+            }
+        }
+    }
+
+    bool endpoint_down(int endpoint) {
+        return reconnect_.get()->count(endpoint);
+    }
+
+    void connect_failed(int endpoint) {
+        metrics_.connect_failures.add();
+        auto now = Clock::now();
+        Clock::time_point retry_at;
+        {
+            auto reconnect = reconnect_.get();
+            auto& state = (*reconnect)[endpoint];
+            // other connections of the same attempt
+            if (now < state.retry_at) {
+                return;
+            }
+            ++state.failures;
+            Clock::duration backoff = reconnect_backoff_;
+            for (size_t i = 1; i < state.failures && backoff < max_reconnect_backoff_; ++i) {
+                backoff *= 2;
+            }
+            backoff = std::min<Clock::duration>(backoff, max_reconnect_backoff_);
+            // jitter keeps clients of a recovering peer from reconnecting at once
+            thread_local std::minstd_rand rng(std::random_device{}());
+            backoff -= std::chrono::duration_cast<Clock::duration>(backoff * std::uniform_real_distribution<double>(0, 0.5)(rng));
+            retry_at = state.retry_at = now + backoff;
+        }
+        schedule_at(retry_at, [this, endpoint] { fix_pool_size(endpoint); });
+    }
+
+    void connected(int endpoint) {
+        if (reconnect_.get()->erase(endpoint)) {
+            fix_pool_size(endpoint);
+        }
+    }
+
+    // opens one more connection if queue stays long for current ones, short bursts don't count
+    void grow_pool(int endpoint, size_t queue_depth) {
+        auto policy = pool_policy(endpoint);
+        if (!policy || endpoint_manager_.transient(endpoint) || !endpoint_manager_.resolved(endpoint)) {
             return;
         }
         size_t pool_size = pool_.count_connections(endpoint);
-        if (pool_size < fixed_pool_size_) {
-            for (; pool_size < fixed_pool_size_; ++pool_size) {
-                SocketHolder sock = endpoint_manager_.socket(endpoint);
-                uint64_t id = pool_.make_id();
-                endpoint_manager_.async_connect(sock, endpoint);
-                auto data = pool_.add(sock.release(), id, endpoint);
-                if (greeter_) {
-                    auto egress_data = data->egress_data.get();
-                    egress_data->message = greeter_(endpoint);
-                    egress_data->offset = 0;
+        bool deep = pool_size < policy->max_connections
+            && queue_depth >= policy->grow_queue_depth * std::max<size_t>(pool_size, 1);
+        auto now = Clock::now();
+        {
+            auto messages = pending_messages_.get();
+            auto& deep_since = (*messages)[endpoint].deep_since;
+            if (!deep) {
+                deep_since = Clock::time_point::max();
+                return;
+            }
+            deep_since = std::min(deep_since, now);
+            if (now - deep_since < policy->grow_after) {
+                return;
+            }
+            // the next connection has to wait out its own period
+            deep_since = Clock::time_point::max();
+        }
+        metrics_.pool_grown.add();
+        connect(endpoint);
+    }
+
+    // called under egress lock of idle connection. Write side is shut down,
+    // so the peer is done with its messages before the connection is closed
+    void retire(ConnData* data) {
+        pool_.retire(data->id);
+        shutdown(data->socket.get(), SHUT_WR);
+        // peer which doesn't close its side would hold the fd forever
+        schedule_at(Clock::now() + kRetireTimeout, [this, id=data->id] {
+                if (auto data = pool_.select(id); data && data->retired) {
+                    metrics_.retire_timeouts.add();
+                    pool_.close(id);
+                }
+            });
+    }
+
+    // retires outgoing connections idle in both directions for policy timeout, down to min_connections
+    void shrink_pools() {
+        auto now = Clock::now();
+        for (int endpoint : pool_.endpoints()) {
+            auto policy = pool_policy(endpoint);
+            if (!policy) {
+                continue;
+            }
+            auto connections = pool_.connections(endpoint);
+            size_t active = 0;
+            for (auto& data : connections) {
+                active += !data->retired;
+            }
+            for (auto& data : connections) {
+                if (active <= policy->min_connections) {
+                    break;
+                }
+                if (!data->outgoing || data->retired || now - data->last_read < policy->idle_timeout) {
+                    continue;
+                }
+                auto egress_data = data->egress_data.try_get();
+                if (egress_data && !egress_data->message && now - egress_data->last_active > policy->idle_timeout) {
+                    retire(data.get());
+                    metrics_.pool_shrunk.add();
+                    --active;
+                }
+            }
+        }
+    }
+
+    void enable_autoscaling() {
+        if (!autoscaling_.exchange(true)) {
+            schedule_shrink();
+        }
+    }
+
+    void schedule_shrink() {
+        auto period = (default_pool_policy_ ? default_pool_policy_->idle_timeout : kShrinkPeriod) / 2;
+        schedule_at(Clock::now() + period, [this] {
+                shrink_pools();
+                schedule_shrink();
+            });
+    }
+
+    // false if connection failed at once
+    bool connect(int endpoint) {
+        SocketHolder sock = endpoint_manager_.socket(endpoint);
+        uint64_t id = pool_.make_id();
+        try {
+            endpoint_manager_.async_connect(sock, endpoint);
+        } catch (const BusError&) {
+            // e.g. nobody listens on unix socket
+            connect_failed(endpoint);
+            return false;
+        }
+        auto data = pool_.add(sock.release(), id, endpoint);
+        data->outgoing = true;
+        data->connecting = true;
+        schedule_at(Clock::now() + connect_timeout_, [this, id, endpoint] {
+                auto data = pool_.select(id);
+                if (data && data->connecting) {
+                    metrics_.connect_timeouts.add();
+                    pool_.close(id);
+                    connect_failed(endpoint);
+                }
+            });
+        data->last_read = Clock::now();
+        data->egress_data.get()->last_active = data->last_read;
+        metrics_.connects.add();
+        if (!endpoint_manager_.unix_endpoint(endpoint)) {
+            setup_tcp_socket(data.get());
+        }
+        if (greeter_) {
+            auto egress_data = data->egress_data.get();
+            egress_data->message = greeter_(endpoint);
+            egress_data->greeting = egress_data->message.has_value();
+            // otherwise checksums go on once greeter is written
+            egress_data->checksums = frame_checksums_ && !egress_data->greeting;
+            egress_data->offset = 0;
+            if (shm_ring_size_ && endpoint_manager_.unix_endpoint(endpoint)) {
+                data->shm = ShmChannel::create(std::max(*shm_ring_size_, 2 * (max_message_size_ + internal::header_len)));
+                egress_data->shm_offer_pending = true;
+                epoll_add_shm(data->shm->wake_fd(), id);
+            }
+        } else if (frame_checksums_) {
+            data->egress_data.get()->checksums = true;
+        }
+        epoll_add(data->socket.get(), id);
+        check_budget();
+        return true;
+    }
+
+    static std::optional<size_t> default_connection_budget() {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur <= 2 * kReservedFds) {
+            return std::nullopt;
+        }
+        return limit.rlim_cur - kReservedFds;
+    }
+
+    // retired connections count against budget till they are closed
+    void check_budget() {
+        if (connection_budget_ && pool_.count_connections() > *connection_budget_ && !eviction_scheduled_.exchange(true)) {
+            schedule_local([this] { enforce_budget(); });
+        }
+    }
+
+    void enforce_budget() {
+        eviction_scheduled_ = false;
+        evict(*connection_budget_);
+    }
+
+    // out of fds: retired connections are closed at once and a couple of idle ones are retired, in loop thread.
+    // False if no fd is released right away
+    bool free_fds() {
+        auto retired = pool_.retired_connections();
+        for (auto& data : retired) {
+            pool_.close(data->id);
+        }
+        size_t count = pool_.count_connections();
+        evict(count > 2 ? count - 2 : 0);
+        return !retired.empty();
+    }
+
+    // level triggered listener would wake the loop till some fds are released
+    void pause_accepting(int listensock, uint64_t id) {
+        auto watch = [this, listensock, id] (uint32_t events) {
+            epoll_event evt;
+            evt.events = events;
+            evt.data.u64 = id;
+            epoll_ctl(epollfd_, EPOLL_CTL_MOD, listensock, &evt);
+        };
+        watch(0);
+        schedule_at(Clock::now() + kAcceptRetry, [watch] { watch(EPOLLIN); });
+    }
+
+    // retires least recently used idle connections, so that the rest fits budget once retired ones are closed.
+    // Runs in loop thread as it owns ingress state. Fds are released once peers close connections
+    void evict(size_t budget) {
+        size_t count = pool_.count_connections();
+        size_t retiring = pool_.count_retired_connections();
+        if (count <= budget + retiring) {
+            return;
+        }
+        for (auto& data : pool_.idle_lru(count - retiring - budget)) {
+            if (data->connecting || data->ingress_offset != 0) {
+                continue;
+            }
+            auto egress_data = data->egress_data.try_get();
+            if (!egress_data || egress_data->message) {
+                continue;
+            }
+            retire(data.get());
+            metrics_.evictions.add();
+        }
+    }
+
+    void setup_tcp_socket(ConnData* data) {
+        if (zerocopy_threshold_) {
+            int one = 1;
+            // unsupported by kernel, plain writes then
+            data->zerocopy = setsockopt(data->socket.get(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        }
+        if (busy_poll_) {
+            // raising it above net.core.busy_read requires CAP_NET_ADMIN, loop spins anyway
+            int usecs = busy_poll_->count();
+            setsockopt(data->socket.get(), SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+        }
+    }
+
+    // drains error queue of zerocopy notifications, false if socket has failed
+    bool handle_zerocopy_completions(ConnData* data) {
+        while (true) {
+            char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(data->socket.get(), &msg, MSG_ERRQUEUE) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                auto err = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cmsg));
+                if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                    continue;
+                }
+                // notifications cover [ee_info, ee_data] and come in order
+                uint32_t last = err->ee_data;
+                auto egress_data = data->egress_data.get();
+                auto& pinned = egress_data->zerocopy_pinned;
+                while (!pinned.empty() && static_cast<int32_t>(last - pinned.front().seq) >= 0) {
+                    pinned.pop_front();
+                    metrics_.zerocopy_completions.add();
+                }
+                if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                    metrics_.zerocopy_copied.add();
                 }
-                epoll_add(data->socket.get(), id);
             }
         }
+        int error = 0;
+        socklen_t len = sizeof(error);
+        return getsockopt(data->socket.get(), SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0;
     }
 
     void handle_read(ConnData* data) {
-        ssize_t message_size = std::numeric_limits<ssize_t>::lowest();
+        if (data->reading_paused) {
+            return;
+        }
+        // connection could be rebound while delivering
+        auto& endpoint_metrics = this->endpoint_metrics(data);
+        size_t bytes_in = 0;
+        size_t messages_in = 0;
+        read_messages(data, bytes_in, messages_in);
+
+        endpoint_metrics.bytes_in.add(bytes_in);
+        endpoint_metrics.messages_in.add(messages_in);
+    }
+
+    void read_messages(ConnData* data, size_t& bytes_in, size_t& messages_in) {
         while (true) {
+            if (data->ingress_offset == 0 && pause_reading(data)) {
+                return;
+            }
             size_t expected = 0;
             bool has_header = false;
             char* data_ptr;
@@ -147,27 +578,58 @@ public:
             } else {
                 has_header = true;
                 size_t message_size = internal::read_header(data->ingress_header);
+                if (message_size > max_message_size_) {
+                    // size is corrupted rather than too big, if frames are checksummed
+                    if (internal::read_checksum(data->ingress_header) || data->ingress_checksums.load(std::memory_order_relaxed)) {
+                        metrics_.checksum_errors.add();
+                        close_and_requeue(data);
+                        return;
+                    }
+                    throw BusError("too big message");
+                }
                 if (!data->ingress_buf.initialized()) {
                     data->ingress_buf = SharedView(buffer_pool_, message_size);
                 }
                 expected = message_size + internal::header_len - data->ingress_offset;
                 data_ptr = data->ingress_buf.data() + (data->ingress_offset - internal::header_len);
             }
-            if (expected > max_message_size_) {
-                throw BusError("too big message");
-            }
-            ssize_t res = read(data->socket.get(), data_ptr, expected);
+            ssize_t res = data->accepts_shm_offer
+                ? ShmChannel::recv_offer(data->socket.get(), data_ptr, expected, data->offered_shm)
+                : read(data->socket.get(), data_ptr, expected);
+            metrics_.read_calls.add();
             if (res >= 0) {
                 data->ingress_offset += res;
+                bytes_in += res;
                 if (has_header && res == expected) {
-                    handler_({.endpoint=data->endpoint, .socket=data->socket.get(), .conn_id=data->id}, SharedView(std::move(data->ingress_buf)));
+                    auto checksum = internal::read_checksum(data->ingress_header);
+                    if (checksum && !data->ingress_checksums.load(std::memory_order_relaxed)) {
+                        data->ingress_checksums.store(true, std::memory_order_relaxed);
+                    }
+                    // stream can't be trusted past corrupted frame
+                    if (checksum
+                        ? internal::frame_checksum(data->ingress_buf.data(), data->ingress_buf.size()) != *checksum
+                        : data->ingress_checksums.load(std::memory_order_relaxed))
+                    {
+                        metrics_.checksum_errors.add();
+                        close_and_requeue(data);
+                        return;
+                    }
+                    ++messages_in;
+                    deliver(data, SharedView(std::move(data->ingress_buf)));
                     data->ingress_buf = SharedView();
                     data->ingress_offset = 0;
+                    if (data->accepts_shm_offer) {
+                        data->accepts_shm_offer = false;
+                        if (data->offered_shm) {
+                            install_shm(data);
+                        }
+                    }
                     continue;
                 }
-                // connection closed by remote peer
+                // connection closed by remote peer, whatever we have written still goes to it
                 if (res == 0) {
-                    pool_.close(data->id);
+                    data->socket.set_graceful_close();
+                    close_and_requeue(data);
                     return;
                 }
                 // os buffer exhausted
@@ -175,59 +637,322 @@ public:
                     return;
                 }
             } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                metrics_.read_eagain.add();
                 return;
             } else if (errno == EINTR) {
                 continue;
             } else {
-                pool_.close(data->id);
+                metrics_.conn_errors.add();
+                close_and_requeue(data);
                 return;
             }
         }
     }
 
+    // peer which closes its write side (e.g. retiring idle connection) drops partially read frame,
+    // so message being written and answers queued behind it go to another connection. Same for connections reset by peer
+    void close_and_requeue(ConnData* data) {
+        std::vector<QueuedMessage> unsent;
+        std::shared_ptr<ConnData> lingering;
+        {
+            auto egress_data = data->egress_data.get();
+            if (data->zerocopy && !egress_data->zerocopy_pinned.empty() && data->socket.graceful_close()) {
+                lingering = pool_.select(data->id);
+            }
+            if (egress_data->message && !egress_data->greeting) {
+                unsent.push_back({ std::move(*egress_data->message), egress_data->trace_id });
+            }
+            egress_data->message.reset();
+            egress_data->checksum.reset();
+            while (!egress_data->answers.empty()) {
+                unsent.push_back({ std::move(egress_data->answers.front()), 0 });
+                egress_data->answers.pop_front();
+            }
+            pool_.close(data->id);
+            // loop thread still holds the connection and would write the requeued messages to it on EPOLLOUT
+            data->retired = true;
+        }
+        if (lingering) {
+            linger_zerocopy(std::move(lingering));
+        }
+        // nobody to reconnect to
+        if (unsent.empty() || endpoint_manager_.transient(data->endpoint)) {
+            return;
+        }
+        {
+            // they were sent before anything still queued, so they go first and keep their order
+            auto& queue = (*pending_messages_.get())[data->endpoint];
+            for (auto it = unsent.rbegin(); it != unsent.rend(); ++it) {
+                queue.bytes += it->message.size();
+                queue.messages.push_front(std::move(*it));
+            }
+        }
+        if (auto other = pool_.take_available(data->endpoint)) {
+            handle_write(other.get());
+        } else {
+            fix_pool_size(data->endpoint);
+        }
+    }
+
+    // kernel still sends queued data of gracefully closed socket from pinned zerocopy buffers,
+    // so the socket is kept open till all of them are completed, or reset after kZeroCopyLinger
+    void linger_zerocopy(std::shared_ptr<ConnData> data) {
+        uint64_t id = data->id;
+        zerocopy_lingering_.emplace(id, std::move(data));
+        metrics_.zerocopy_lingering.add();
+        schedule_at(Clock::now() + kZeroCopyLinger, [this, id] {
+                if (auto it = zerocopy_lingering_.find(id); it != zerocopy_lingering_.end()) {
+                    // RST drops send queue, so buffers can be released along with the socket
+                    it->second->socket.set_graceful_close(false);
+                    zerocopy_lingering_.erase(it);
+                }
+            });
+    }
+
+    bool over_inflight_limit(ConnData* data) {
+        return (max_connection_inflight_bytes_ && data->inflight_bytes.load() >= *max_connection_inflight_bytes_)
+            || (max_inflight_bytes_ && inflight_bytes_.load() >= *max_inflight_bytes_);
+    }
+
+    // loop stops reading connection till handlers release enough bytes, kernel buffers fill up
+    // and tcp flow control slows the sender down
+    bool pause_reading(ConnData* data) {
+        if (!over_inflight_limit(data)) {
+            return false;
+        }
+        paused_count_.fetch_add(1);
+        // release could have missed the pause, it checks paused_count_ after decreasing inflight bytes
+        if (!over_inflight_limit(data)) {
+            paused_count_.fetch_sub(1);
+            return false;
+        }
+        data->reading_paused = true;
+        paused_reads_.push_back(data->id);
+        metrics_.read_pauses.add();
+        return true;
+    }
+
+    void release(uint64_t conn_id, size_t bytes) {
+        if (conn_id == ConnHandle::kDatagramConnId || !(max_connection_inflight_bytes_ || max_inflight_bytes_)) {
+            return;
+        }
+        inflight_bytes_.fetch_sub(bytes);
+        // local deliveries count against max_inflight_bytes only, there is no connection for them
+        if (auto data = pool_.select(conn_id)) {
+            data->inflight_bytes.fetch_sub(bytes);
+        }
+        if (paused_count_.load() > 0 && !resume_scheduled_.exchange(true)) {
+            schedule_local([this] { resume_reading(); });
+        }
+    }
+
+    void resume_reading() {
+        resume_scheduled_ = false;
+        while (!paused_local_.empty() && !over_local_inflight_limit()) {
+            auto local = std::move(paused_local_.front());
+            paused_local_.pop_front();
+            handle_local(std::move(local));
+        }
+        if (local_paused_ && paused_local_.empty()) {
+            local_paused_ = false;
+            paused_count_.fetch_sub(1);
+        }
+        std::vector<uint64_t> paused;
+        paused.swap(paused_reads_);
+        for (uint64_t id : paused) {
+            paused_count_.fetch_sub(1);
+            auto data = pool_.select(id);
+            if (!data) {
+                continue;
+            }
+            data->reading_paused = false;
+            // pauses again if still over limit
+            if (data->shm) {
+                handle_shm(data.get());
+            } else {
+                handle_read(data.get());
+            }
+        }
+    }
+
+    void deliver(ConnData* data, SharedView message) {
+        metrics_.message_size_in.record(message.size());
+        if (max_connection_inflight_bytes_ || max_inflight_bytes_) {
+            data->inflight_bytes.fetch_add(message.size());
+            inflight_bytes_.fetch_add(message.size());
+        }
+        if (autoscaling_.load(std::memory_order_relaxed)) {
+            data->last_read = Clock::now();
+        }
+        uint64_t trace_id = trace::sample();
+        trace::record(trace_id, trace::Stage::ReadDone, data->endpoint);
+        handler_({.endpoint=data->endpoint, .socket=data->socket.get(), .conn_id=data->id, .trace_id=trace_id}, std::move(message));
+    }
+
+    // peer offered shm channel with the greeter, next frames come thru it
+    void install_shm(ConnData* data) {
+        {
+            auto egress_data = data->egress_data.get();
+            data->shm = std::move(data->offered_shm);
+        }
+        epoll_add_shm(data->shm->wake_fd(), data->id);
+        handle_shm(data);
+    }
+
+    void handle_shm(ConnData* data) {
+        data->shm->drain_wake();
+        size_t messages_in = 0;
+        size_t bytes_in = 0;
+        bool paused = data->reading_paused;
+        while (!paused) {
+            while (auto size = data->shm->peek()) {
+                // consumer stays unparked, so resume_reading picks the ring up
+                if (pause_reading(data)) {
+                    paused = true;
+                    break;
+                }
+                if (*size > max_message_size_) {
+                    throw BusError("too big message");
+                }
+                SharedView message(buffer_pool_, *size);
+                data->shm->read(message.data(), *size);
+                ++messages_in;
+                bytes_in += internal::header_len + *size;
+                deliver(data, std::move(message));
+            }
+            if (paused || data->shm->park()) {
+                break;
+            }
+        }
+        auto& endpoint_metrics = this->endpoint_metrics(data);
+        endpoint_metrics.bytes_in.add(bytes_in);
+        endpoint_metrics.messages_in.add(messages_in);
+
+        // we could be parked as producer too
+        handle_write(data);
+    }
+
+    bool has_pending(int endpoint) {
+        auto messages = pending_messages_.get();
+        auto it = messages->find(endpoint);
+        return it != messages->end() && !it->second.messages.empty();
+    }
+
+    // messages at queue head which are past deadline go to drop handler instead of the wire
+    void drop_expired(int endpoint, PendingQueue& queue) {
+        if (queue.messages.empty() || queue.messages.front().deadline == Clock::time_point::max()) {
+            return;
+        }
+        auto now = Clock::now();
+        std::vector<SharedView> expired;
+        while (!queue.messages.empty() && queue.messages.front().deadline <= now) {
+            queue.bytes -= queue.messages.front().message.size();
+            expired.push_back(std::move(queue.messages.front().message));
+            queue.messages.pop_front();
+        }
+        if (expired.empty()) {
+            return;
+        }
+        metrics_.expired_messages.add(expired.size());
+        if (drop_handler_) {
+            schedule_local([this, endpoint, expired=std::move(expired)] {
+                    for (auto& message : expired) {
+                        drop_handler_(endpoint, message);
+                    }
+                });
+        }
+    }
+
     void handle_write(ConnData* data) {
         auto egress_data = data->egress_data.try_get();
         if (!egress_data) {
             return;
         }
+        write_queued(data, egress_data);
+    }
+
+    // writes answers, then endpoint queue, till socket is full or both are empty
+    template<typename Lock>
+    void write_queued(ConnData* data, internal::ExclusiveGuard<ConnData::EgressData, Lock>& egress_data) {
+        if (data->retired) {
+            // idle connection was retired under us, queue goes to the others
+            egress_data.unlock();
+            if (auto other = pool_.take_available(data->endpoint)) {
+                handle_write(other.get());
+            } else {
+                fix_pool_size(data->endpoint);
+            }
+            return;
+        }
         while (1) {
             if (!try_write_message(data, egress_data)) {
                 return;
             }
+            if (!egress_data->message && !egress_data->answers.empty()) {
+                egress_data->message = std::move(egress_data->answers.front());
+                egress_data->answers.pop_front();
+                egress_data->offset = 0;
+                egress_data->trace_id = 0;
+                egress_data->last_active = Clock::now();
+                continue;
+            }
             if (!egress_data->message) {
                 auto messages = pending_messages_.get();
                 auto& queue = (*messages)[data->endpoint];
-                if (queue.empty()) {
+                drop_expired(data->endpoint, queue);
+                if (queue.messages.empty()) {
                     pool_.set_available(data->id);
+                    messages.unlock();
+                    egress_data.unlock();
+                    // idle connection could be evicted now
+                    check_budget();
+                    // send could have queued a message while this connection was busy and found no available one
+                    if (has_pending(data->endpoint)) {
+                        if (auto other = pool_.take_available(data->endpoint)) {
+                            handle_write(other.get());
+                        }
+                    }
                     return;
                 }
-                egress_data->message = queue.front();
+                auto& front = queue.messages.front();
+                queue.bytes -= front.message.size();
+                egress_data->message = std::move(front.message);
+                egress_data->trace_id = front.trace_id;
                 egress_data->offset = 0;
-                (*messages)[data->endpoint].pop();
+                egress_data->last_active = Clock::now();
+                trace::record(egress_data->trace_id, trace::Stage::Dequeue, data->endpoint);
+                queue.messages.pop_front();
+                update_queue_depth(data->endpoint, queue);
             }
         }
     }
 
-    void rearm_timer() {
+    // runs due actions and arms timerfd for the next one, now is refreshed only after running an action
+    void rearm_timer(Clock::time_point now) {
         while (true) {
             auto mp = action_map_.get();
             auto next = mp->next_time_point();
             if (!next) return;
-            auto now = std::chrono::system_clock::now();
-            auto interval = *next - now;
-            auto secs = std::chrono::duration_cast<std::chrono::seconds>(interval);
-            auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(interval - secs);
-            if (nsecs.count() < 1) {
+            if (*next <= now) {
                 auto action = mp->pick_action();
                 mp.unlock();
                 assert(action);
                 action();
+                now = Clock::now();
             } else {
-                if (interval > kSpinThreshold) {
+                if (*next - now > kSpinThreshold) {
+                    // steady clock is CLOCK_MONOTONIC, so deadline is armed as is
+                    auto deadline = next->time_since_epoch();
+                    if (timer_slack_.count() > 0) {
+                        auto slack = std::chrono::duration_cast<Clock::duration>(timer_slack_);
+                        deadline = (deadline + slack - Clock::duration(1)) / slack * slack;
+                    }
+                    auto secs = std::chrono::duration_cast<std::chrono::seconds>(deadline);
+                    auto nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - secs);
                     itimerspec spec;
                     spec.it_interval = { 0, 0 };
                     spec.it_value = { secs.count(), nsecs.count() };
-                    timerfd_settime(timerfd_, 0, &spec, nullptr);
+                    timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &spec, nullptr);
                 }
                 return;
             }
@@ -235,16 +960,35 @@ public:
     }
 
     void loop() {
+        // ProtoBus reschedules loop() on its executor till it is destroyed
+        if (stopped_.load()) {
+            return;
+        }
+        if (loop_cpu_) {
+            internal::pin_thread(*loop_cpu_);
+        }
         std::vector<epoll_event> event_buf;
         bool to_break = false;
+        auto poll_until = Clock::time_point::min();
         while (!to_break) {
             event_buf.resize(pool_.count_connections() + 10);
-            bool to_spin = action_map_.get()->next_time_point().value_or(std::chrono::system_clock::time_point::max()) < std::chrono::system_clock::now() + kSpinThreshold;
-            int ready = epoll_wait(epollfd_, event_buf.data(), event_buf.size(), to_spin ? 0 : -1);
+            auto now = Clock::now();
+            bool to_spin = action_map_.get()->next_time_point().value_or(Clock::time_point::max()) < now + kSpinThreshold;
+            bool to_poll = busy_poll_ && now < poll_until;
+            int ready = epoll_wait(epollfd_, event_buf.data(), event_buf.size(), to_spin || to_poll ? 0 : -1);
             if (ready < 0 && errno == EINTR) {
                 continue;
             }
             CHECK_ERRNO(ready >= 0);
+            // single clock read per wakeup, shared by timer handling below
+            now = ready > 0 ? Clock::now() : now;
+            if (busy_poll_) {
+                if (ready > 0) {
+                    poll_until = now + *busy_poll_;
+                } else if (to_poll) {
+                    metrics_.empty_polls.add();
+                }
+            }
             for (size_t i = 0; i < ready; ++i) {
                 uint64_t id = event_buf[i].data.u64;
                 auto read_uint64 = [] (int fd) {
@@ -253,35 +997,60 @@ public:
                 };
                 if (id == timerctl_id_) {
                     read_uint64(timerctlfd_);
-                    rearm_timer();
+                    rearm_timer(now);
                 } else if (id == timer_id_) {
                     read_uint64(timerfd_);
-                    rearm_timer();
+                    metrics_.timer_wakeups.add();
+                    rearm_timer(now);
                 } else if (id == break_id_) {
                     CHECK_ERRNO(read_uint64(breakfd_));
                     to_break = true;
                 } else if (id == listen_id_) {
-                    accept_conns();
+                    accept_conns(listensock_);
+                } else if (id == unix_listen_id_) {
+                    accept_conns(unix_listensock_.get());
+                } else if (datagram_socket_ && id == datagram_id_) {
+                    if (event_buf[i].events & EPOLLIN) {
+                        receive_datagrams();
+                    }
+                    if (event_buf[i].events & EPOLLOUT) {
+                        flush_datagrams();
+                    }
+                } else if (id & kShmWakeBit) {
+                    if (auto data = pool_.select(id & ~kShmWakeBit)) {
+                        handle_shm(data.get());
+                    }
                 } else if (auto data = pool_.select(id)) {
                     int endpoint = data->endpoint;
-                    if (event_buf[i].events & EPOLLERR) {
-                        pool_.close(id);
+                    if ((event_buf[i].events & EPOLLERR) && !(data->zerocopy && handle_zerocopy_completions(data.get()))) {
+                        bool connecting = data->connecting;
+                        close_and_requeue(data.get());
+                        if (connecting) {
+                            connect_failed(endpoint);
+                        }
                         fix_pool_size(endpoint);
                         continue;
                     }
+                    if ((event_buf[i].events & EPOLLOUT) && data->connecting.exchange(false)) {
+                        connected(endpoint);
+                    }
                     if (event_buf[i].events & EPOLLIN) {
                         handle_read(data.get());
                     }
                     if (data && (event_buf[i].events & EPOLLOUT) != 0) {
                         handle_write(data.get());
                     }
+                } else if (auto it = zerocopy_lingering_.find(id); it != zerocopy_lingering_.end()) {
+                    if (!handle_zerocopy_completions(it->second.get()) || it->second->egress_data.get()->zerocopy_pinned.empty()) {
+                        zerocopy_lingering_.erase(it);
+                    }
                 }
             }
             if (to_spin) {
                 auto action = action_map_.get()->pick_action();
                 if (action) {
                     action();
-                    rearm_timer();
+                    rearm_timer(Clock::now());
                 }
             }
         }
@@ -293,10 +1062,18 @@ public:
             return true;
         }
 
+        if (data->shm && !egress_data->shm_offer_pending) {
+            return try_write_shm(data, egress_data);
+        }
+
         int fd = data->socket.get();
 
+        // whether frame has checksum is decided before its first byte
+        if (egress_data->checksums && egress_data->offset == 0 && !egress_data->checksum) {
+            egress_data->checksum = internal::frame_checksum(egress_data->message->data(), egress_data->message->size());
+        }
         char header[internal::header_len];
-        internal::write_header(egress_data->message->size(), header);
+        internal::write_header(egress_data->message->size(), header, egress_data->checksum);
 
         while (true) {
             iovec iov_holder[2];
@@ -315,57 +1092,411 @@ public:
             if (iovcnt == 0) {
                 return true;
             }
+            const MappedFile* file = egress_data->shm_offer_pending ? nullptr : egress_data->message->file();
+            bool zerocopy = !file && data->zerocopy && egress_data->message->size() >= *zerocopy_threshold_;
+            if (zerocopy) {
+                // header is referenced by kernel as well, so it is pinned along with the message
+                auto& pinned = egress_data->zerocopy_pinned.emplace_back(
+                    ConnData::ZeroCopyBuffer{ .seq = egress_data->zerocopy_seq, .message = *egress_data->message });
+                memcpy(pinned.header, header, internal::header_len);
+                if (iov == iov_holder) {
+                    iov[0].iov_base = pinned.header;
+                }
+            }
             if (offset > 0) {
                 iov[0].iov_base = ((char*)iov[0].iov_base) + offset;
                 iov[0].iov_len -= offset;
             }
-            ssize_t res = writev(fd, iov, iovcnt);
+            ssize_t res;
+            if (egress_data->shm_offer_pending && egress_data->offset == 0) {
+                res = ShmChannel::send_offer(fd, iov, iovcnt, data->shm->fds());
+            } else if (file && iov == iov_holder) {
+                // file contents follow the header with sendfile
+                msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = 1;
+                res = sendmsg(fd, &msg, MSG_MORE | MSG_NOSIGNAL);
+            } else if (file) {
+                off_t file_offset = egress_data->message->file_offset() + offset;
+                res = sendfile(fd, file->fd(), &file_offset, iov[0].iov_len);
+                metrics_.sendfile_calls.add();
+            } else if (zerocopy) {
+                msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = iovcnt;
+                res = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+                if (res >= 0) {
+                    ++egress_data->zerocopy_seq;
+                    metrics_.zerocopy_sends.add();
+                } else {
+                    egress_data->zerocopy_pinned.pop_back();
+                    if (errno == ENOBUFS) {
+                        // out of optmem for notifications, plain write goes on
+                        res = writev(fd, iov, iovcnt);
+                    }
+                }
+            } else {
+                res = writev(fd, iov, iovcnt);
+            }
+            metrics_.writev_calls.add();
             if (res >= 0) {
+                auto& endpoint_metrics = this->endpoint_metrics(data);
+                endpoint_metrics.bytes_out.add(res);
                 egress_data->offset += res;
                 if (egress_data->offset == internal::header_len + egress_data->message->size()) {
+                    endpoint_metrics.messages_out.add();
+                    metrics_.message_size_out.record(egress_data->message->size());
+                    trace::record(egress_data->trace_id, trace::Stage::WriteDone, data->endpoint);
                     egress_data->message.reset();
+                    egress_data->checksum.reset();
+                    egress_data->trace_id = 0;
+                    egress_data->shm_offer_pending = false;
+                    if (egress_data->greeting) {
+                        egress_data->greeting = false;
+                        egress_data->checksums = frame_checksums_;
+                    }
+                } else {
+                    metrics_.partial_writes.add();
                 }
                 return true;
             } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                metrics_.write_eagain.add();
                 return false;
             } else if (errno == EINTR) {
                 continue;
             } else {
-                pool_.close(data->id);
+                metrics_.conn_errors.add();
+                // egress lock is held here, unsent messages are taken back in loop thread
+                schedule_local([this, id=data->id] {
+                        if (auto data = pool_.select(id)) {
+                            close_and_requeue(data.get());
+                        }
+                    });
                 return false;
             }
         }
     }
 
-    void answer(uint64_t conn_id, SharedView message) {
-        if (auto data = pool_.select(conn_id)) {
-            auto egress_data = data->egress_data.get();
-            if (egress_data->message) {
-                throw BusError("answer in bound connection");
+    template<typename Lock>
+    bool try_write_shm(ConnData* data, internal::ExclusiveGuard<ConnData::EgressData, Lock>& egress_data) {
+        auto& message = *egress_data->message;
+        if (!data->shm->write(message.data(), message.size())) {
+            metrics_.write_eagain.add();
+            return false;
+        }
+        auto& endpoint_metrics = this->endpoint_metrics(data);
+        endpoint_metrics.bytes_out.add(internal::header_len + message.size());
+        endpoint_metrics.messages_out.add();
+        metrics_.message_size_out.record(message.size());
+        trace::record(egress_data->trace_id, trace::Stage::WriteDone, data->endpoint);
+        egress_data->message.reset();
+        egress_data->trace_id = 0;
+        return true;
+    }
+
+    bool answer(uint64_t conn_id, SharedView message) {
+        auto data = pool_.select(conn_id);
+        if (!data) {
+            return false;
+        }
+        auto egress_data = data->egress_data.get();
+        // write side of retired connection is shut down
+        if (data->retired) {
+            return false;
+        }
+        egress_data->answers.push_back(std::move(message));
+        // unless a write is in progress, this thread writes and takes over the endpoint queue as well,
+        // as if the connection was taken available
+        if (!egress_data->message) {
+            write_queued(data.get(), egress_data);
+        }
+        return true;
+    }
+
+    static internal::ExclusiveWrapper<std::unordered_map<std::string, Impl*>>& local_buses() {
+        static internal::ExclusiveWrapper<std::unordered_map<std::string, Impl*>> buses;
+        return buses;
+    }
+
+    // bus of this process which could serve endpoint, along with messages on the way to it
+    struct LocalRoute {
+        explicit LocalRoute(std::string key)
+            : key(std::move(key))
+        {
+        }
+
+        const std::string key;
+        std::atomic<size_t> messages = 0;
+        std::atomic<size_t> bytes = 0;
+    };
+
+    struct LocalMessage {
+        SharedView message;
+        // the sender and its endpoint of the receiver, the one drop handler gets
+        int sender_port;
+        int endpoint;
+        uint64_t trace_id;
+        Clock::time_point deadline;
+        std::shared_ptr<LocalRoute> route;
+    };
+
+    // null for endpoints which can't be served locally. Cached till endpoint changes address
+    std::shared_ptr<LocalRoute> local_route(int endpoint) {
+        auto routes = local_routes_.get();
+        if (auto it = routes->find(endpoint); it != routes->end()) {
+            return it->second;
+        }
+        std::shared_ptr<LocalRoute> route;
+        if (auto port = endpoint_manager_.loopback_port(endpoint)) {
+            route = std::make_shared<LocalRoute>("tcp:" + std::to_string(*port));
+        } else if (auto path = endpoint_manager_.unix_path(endpoint)) {
+            route = std::make_shared<LocalRoute>("unix:" + *path);
+        } else if (!endpoint_manager_.resolved(endpoint)) {
+            // not cached till the address is known
+            return nullptr;
+        }
+        return (*routes)[endpoint] = std::move(route);
+    }
+
+    // nullopt if no bus of this process serves endpoint, otherwise whether message is accepted.
+    // Messages on the way count against max_pending_messages and max_pending_bytes, as queued ones do
+    std::optional<bool> try_send_local(int endpoint, SharedView& message, Clock::time_point deadline) {
+        auto route = local_route(endpoint);
+        if (!route) {
+            return std::nullopt;
+        }
+        auto buses = local_buses().get();
+        auto it = buses->find(route->key);
+        if (it == buses->end()) {
+            return std::nullopt;
+        }
+        size_t size = message.size();
+        size_t messages = route->messages.fetch_add(1) + 1;
+        size_t bytes = route->bytes.fetch_add(size) + size;
+        if ((max_pending_messages_ && messages > *max_pending_messages_) || (max_pending_bytes_ && bytes > *max_pending_bytes_)) {
+            route->messages.fetch_sub(1);
+            route->bytes.fetch_sub(size);
+            metrics_.rejected_messages.add();
+            return false;
+        }
+        Impl* target = it->second;
+        metrics_.local_messages.add();
+        uint64_t trace_id = trace::sample();
+        trace::record(trace_id, trace::Stage::Enqueue, endpoint);
+        LocalMessage local{
+            .message = std::move(message),
+            .sender_port = port_,
+            .endpoint = endpoint,
+            .trace_id = trace_id,
+            .deadline = deadline,
+            .route = std::move(route),
+        };
+        // bus is unregistered under the same lock before destruction, so target is alive here
+        target->schedule_local([target, local=std::move(local)] () mutable {
+                target->deliver_local(std::move(local));
+            });
+        return true;
+    }
+
+    bool over_local_inflight_limit() {
+        return max_inflight_bytes_ && inflight_bytes_.load() >= *max_inflight_bytes_;
+    }
+
+    // loop thread only. Local messages wait behind paused ones while handlers hold max_inflight_bytes,
+    // then senders hit their pending limits
+    void deliver_local(LocalMessage local) {
+        if (paused_local_.empty() && !over_local_inflight_limit()) {
+            handle_local(std::move(local));
+            return;
+        }
+        paused_local_.push_back(std::move(local));
+        if (!local_paused_) {
+            local_paused_ = true;
+            paused_count_.fetch_add(1);
+            metrics_.read_pauses.add();
+            // release could have missed the pause, it checks paused_count_ after decreasing inflight bytes
+            if (!over_local_inflight_limit() && !resume_scheduled_.exchange(true)) {
+                schedule_local([this] { resume_reading(); });
             }
-            egress_data->message = std::move(message);
-            egress_data->offset = 0;
-            try_write_message(data.get(), egress_data);
         }
     }
 
-    bool send(int endpoint, SharedView message) {
+    void handle_local(LocalMessage local) {
+        local.route->messages.fetch_sub(1);
+        local.route->bytes.fetch_sub(local.message.size());
+        if (local.deadline <= Clock::now()) {
+            // sender is alive while it is registered
+            auto buses = local_buses().get();
+            if (auto it = buses->find("tcp:" + std::to_string(local.sender_port)); it != buses->end()) {
+                it->second->drop_local(local.endpoint, std::move(local.message));
+            }
+            return;
+        }
+        if (max_connection_inflight_bytes_ || max_inflight_bytes_) {
+            inflight_bytes_.fetch_add(local.message.size());
+        }
+        int sender = endpoint_manager_.resolve_loopback(local.sender_port);
+        trace::record(local.trace_id, trace::Stage::ReadDone, sender);
+        handler_({.endpoint=sender, .socket=-1, .conn_id=ConnHandle::kLocalConnId, .trace_id=local.trace_id}, std::move(local.message));
+    }
+
+    // local message expired before receiver's loop got to it
+    void drop_local(int endpoint, SharedView message) {
+        metrics_.expired_messages.add();
+        if (drop_handler_) {
+            schedule_local([this, endpoint, message=std::move(message)] {
+                    drop_handler_(endpoint, message);
+                });
+        }
+    }
+
+    void schedule_at(Clock::time_point when, Task what) {
+        action_map_.get()->insert(when, std::move(what));
+        uint64_t val = 1;
+        CHECK_ERRNO(write(timerctlfd_, &val, sizeof(val)) == sizeof(val));
+    }
+
+    void schedule_local(Task what) {
+        schedule_at(Clock::time_point::min(), std::move(what));
+    }
+
+    bool send(int endpoint, SharedView message, std::optional<Clock::time_point> deadline) {
+        if (local_delivery_) {
+            if (auto accepted = try_send_local(endpoint, message, deadline.value_or(Clock::time_point::max()))) {
+                return *accepted;
+            }
+        }
+        if (endpoint_down(endpoint)) {
+            metrics_.down_rejected.add();
+            return false;
+        }
         fix_pool_size(endpoint);
+        size_t queue_depth;
         {
             auto messages = pending_messages_.get();
             auto& queue = (*messages)[endpoint];
-            if (!max_pending_messages_ || *max_pending_messages_ > queue.size()) {
-                queue.push(std::move(message));
+            bool fits = (!max_pending_messages_ || *max_pending_messages_ > queue.messages.size())
+                && (!max_pending_bytes_ || *max_pending_bytes_ >= queue.bytes + message.size());
+            if (fits) {
+                uint64_t trace_id = trace::sample();
+                trace::record(trace_id, trace::Stage::Enqueue, endpoint);
+                queue.bytes += message.size();
+                queue.messages.push_back({ std::move(message), trace_id, deadline.value_or(Clock::time_point::max()) });
+                queue_depth = queue.messages.size();
+                update_queue_depth(endpoint, queue);
             } else {
+                metrics_.rejected_messages.add();
                 return false;
             }
         }
         if (auto available_connection = pool_.take_available(endpoint)) {
             handle_write(available_connection.get());
         }
+        if (autoscaling_.load(std::memory_order_relaxed)) {
+            grow_pool(endpoint, queue_depth);
+        }
+        return true;
+    }
+
+    EndpointMetrics& endpoint_metrics(int endpoint) {
+        auto by_endpoint = endpoint_metrics_.get();
+        auto& result = (*by_endpoint)[endpoint];
+        if (!result) {
+            result = std::make_unique<EndpointMetrics>(metrics_registry_, endpoint);
+        }
+        return *result;
+    }
+
+    // cached in connection, so that reads and writes skip the map
+    EndpointMetrics& endpoint_metrics(ConnData* data) {
+        auto metrics = data->metrics.load(std::memory_order_acquire);
+        if (!metrics) {
+            metrics = &endpoint_metrics(data->endpoint);
+            // rebind could have stored metrics of the new endpoint meanwhile
+            EndpointMetrics* expected = nullptr;
+            if (!data->metrics.compare_exchange_strong(expected, metrics)) {
+                metrics = expected;
+            }
+        }
+        return *metrics;
+    }
+
+    // pending messages lock is held
+    void update_queue_depth(int endpoint, PendingQueue& queue) {
+        if (!queue.metrics) {
+            queue.metrics = &endpoint_metrics(endpoint);
+        }
+        queue.metrics->queue_depth.set(queue.messages.size());
+    }
+
+    void epoll_add_shm(int wake_fd, uint64_t id) {
+        epoll_event evt;
+        evt.events = EPOLLIN | EPOLLET;
+        evt.data.u64 = id | kShmWakeBit;
+        CHECK_ERRNO(epoll_ctl(epollfd_, EPOLL_CTL_ADD, wake_fd, &evt) == 0);
+    }
+
+    size_t max_datagram_size() const {
+        return std::min(max_message_size_, DatagramSocket::kMaxPayload);
+    }
+
+    bool send_datagram(int endpoint, SharedView message) {
+        if (!datagram_socket_) {
+            throw BusError("datagrams are not enabled");
+        }
+        if (message.size() > max_datagram_size()) {
+            throw BusError("message doesn't fit into datagram");
+        }
+        auto addr = endpoint_manager_.datagram_address(endpoint);
+        if (!addr || pending_datagrams_.fetch_add(1) >= max_pending_datagrams_) {
+            if (addr) {
+                pending_datagrams_.fetch_sub(1);
+            }
+            metrics_.datagrams_rejected.add();
+            return false;
+        }
+        datagram_queue_.get()->push_back({ *addr, std::move(message) });
+        // datagrams sent till the loop gets to them go out in one batch
+        if (!datagram_flush_scheduled_.exchange(true)) {
+            schedule_local([this] { flush_datagrams(); });
+        }
         return true;
     }
 
+    // loop thread only, rest waits for EPOLLOUT if socket buffer is full
+    void flush_datagrams() {
+        datagram_flush_scheduled_ = false;
+        {
+            auto queue = datagram_queue_.get();
+            std::move(queue->begin(), queue->end(), std::back_inserter(datagram_backlog_));
+            queue->clear();
+        }
+        size_t queued = datagram_backlog_.size();
+        auto stats = datagram_socket_->send(datagram_backlog_);
+        pending_datagrams_.fetch_sub(queued - datagram_backlog_.size());
+        metrics_.datagrams_out.add(stats.datagrams);
+        metrics_.datagram_errors.add(stats.errors);
+        metrics_.datagram_syscalls.add(stats.syscalls);
+    }
+
+    void receive_datagrams() {
+        auto stats = datagram_socket_->receive(buffer_pool_, max_datagram_size(), [this] (const sockaddr_in6& addr, SharedView message) {
+                metrics_.message_size_in.record(message.size());
+                ConnHandle handle{
+                    // unknown sources aren't registered, anyone could send from any port
+                    .endpoint = endpoint_manager_.find(addr),
+                    .socket = datagram_socket_->fd(),
+                    .conn_id = ConnHandle::kDatagramConnId,
+                };
+                handler_(handle, std::move(message));
+            });
+        metrics_.datagrams_in.add(stats.datagrams);
+        metrics_.datagram_errors.add(stats.errors);
+        metrics_.datagram_syscalls.add(stats.syscalls);
+    }
+
     uint64_t epoll_add(int fd, uint64_t id) {
         epoll_event evt;
         evt.events = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLET;
@@ -376,37 +1507,201 @@ public:
 
 public:
     static constexpr auto kSpinThreshold = std::chrono::microseconds(1);
+    // fds left for listeners, files and the rest of process by default connection budget
+    static constexpr size_t kReservedFds = 64;
+    // idle connections check without default pool policy
+    static constexpr auto kShrinkPeriod = std::chrono::seconds(1);
+    // retired connection is closed by us unless peer closes it by then
+    static constexpr auto kRetireTimeout = std::chrono::seconds(10);
+    // accepting is paused that long when process is out of fds
+    static constexpr auto kAcceptRetry = std::chrono::milliseconds(100);
+    // gracefully closed socket waits that long for zerocopy completions before it's reset
+    static constexpr auto kZeroCopyLinger = std::chrono::seconds(5);
+    // marks events of shm channel wake fd, connection ids never get that high
+    static constexpr uint64_t kShmWakeBit = 1ull << 63;
+
+    struct BusMetrics {
+        BusMetrics(Metrics& metrics)
+            : read_calls(metrics.counter("tcp.read_calls"))
+            , writev_calls(metrics.counter("tcp.writev_calls"))
+            , read_eagain(metrics.counter("tcp.read_eagain"))
+            , write_eagain(metrics.counter("tcp.write_eagain"))
+            , partial_writes(metrics.counter("tcp.partial_writes"))
+            , connects(metrics.counter("tcp.connects"))
+            , accepts(metrics.counter("tcp.accepts"))
+            , conn_errors(metrics.counter("tcp.conn_errors"))
+            , checksum_errors(metrics.counter("tcp.checksum_errors"))
+            , fd_exhausted(metrics.counter("tcp.fd_exhausted"))
+            , rejected_messages(metrics.counter("tcp.rejected_messages"))
+            , local_messages(metrics.counter("tcp.local_messages"))
+            , zerocopy_sends(metrics.counter("tcp.zerocopy_sends"))
+            , sendfile_calls(metrics.counter("tcp.sendfile_calls"))
+            , empty_polls(metrics.counter("tcp.empty_polls"))
+            , timer_wakeups(metrics.counter("tcp.timer_wakeups"))
+            , pool_grown(metrics.counter("tcp.pool_grown"))
+            , pool_shrunk(metrics.counter("tcp.pool_shrunk"))
+            , connect_failures(metrics.counter("tcp.connect_failures"))
+            , connect_timeouts(metrics.counter("tcp.connect_timeouts"))
+            , down_rejected(metrics.counter("tcp.down_rejected"))
+            , evictions(metrics.counter("tcp.evictions"))
+            , retire_timeouts(metrics.counter("tcp.retire_timeouts"))
+            , expired_messages(metrics.counter("tcp.expired_messages"))
+            , read_pauses(metrics.counter("tcp.read_pauses"))
+            , datagrams_out(metrics.counter("udp.datagrams_out"))
+            , datagrams_in(metrics.counter("udp.datagrams_in"))
+            , datagram_syscalls(metrics.counter("udp.syscalls"))
+            , datagram_errors(metrics.counter("udp.errors"))
+            , datagrams_rejected(metrics.counter("udp.rejected"))
+            , zerocopy_completions(metrics.counter("tcp.zerocopy_completions"))
+            , zerocopy_copied(metrics.counter("tcp.zerocopy_copied"))
+            , zerocopy_lingering(metrics.counter("tcp.zerocopy_lingering"))
+            , message_size_in(metrics.histogram("tcp.message_size_in"))
+            , message_size_out(metrics.histogram("tcp.message_size_out"))
+        {
+        }
+
+        internal::Counter& read_calls;
+        internal::Counter& writev_calls;
+        internal::Counter& read_eagain;
+        internal::Counter& write_eagain;
+        internal::Counter& partial_writes;
+        // outgoing connections opened by fix_pool_size
+        internal::Counter& connects;
+        internal::Counter& accepts;
+        internal::Counter& conn_errors;
+        // connections closed on frame with bad crc32c
+        internal::Counter& checksum_errors;
+        internal::Counter& fd_exhausted;
+        // send refused because of max_pending_messages or max_pending_bytes
+        internal::Counter& rejected_messages;
+        // handed to a bus of this process without sockets
+        internal::Counter& local_messages;
+        internal::Counter& zerocopy_sends;
+        internal::Counter& sendfile_calls;
+        // busy poll iterations which found nothing
+        internal::Counter& empty_polls;
+        internal::Counter& timer_wakeups;
+        internal::Counter& pool_grown;
+        internal::Counter& pool_shrunk;
+        internal::Counter& connect_failures;
+        internal::Counter& connect_timeouts;
+        // send refused because endpoint waits for reconnect
+        internal::Counter& down_rejected;
+        // idle connections closed to stay within connection budget
+        internal::Counter& evictions;
+        // retired connections closed by us since peer kept them open
+        internal::Counter& retire_timeouts;
+        // dropped from queue at deadline
+        internal::Counter& expired_messages;
+        // reading stopped because of inflight bytes limits
+        internal::Counter& read_pauses;
+        internal::Counter& datagrams_out;
+        internal::Counter& datagrams_in;
+        // sendmmsg and recvmmsg calls
+        internal::Counter& datagram_syscalls;
+        // refused by kernel or truncated
+        internal::Counter& datagram_errors;
+        // unresolved endpoint or full queue
+        internal::Counter& datagrams_rejected;
+        internal::Counter& zerocopy_completions;
+        // completions for which kernel fell back to copying, e.g. on loopback
+        internal::Counter& zerocopy_copied;
+        // gracefully closed connections kept open for zerocopy completions
+        internal::Counter& zerocopy_lingering;
+        internal::Histogram& message_size_in;
+        internal::Histogram& message_size_out;
+    };
 
 public:
     std::function<void(ConnHandle, SharedView)> handler_;
     std::function<std::optional<SharedView>(int endpoint)> greeter_;
+    std::function<void(int endpoint, SharedView)> drop_handler_;
 
     int epollfd_;
     int listensock_;
+    SocketHolder unix_listensock_;
     int breakfd_;
+    // set by to_break, loop() returns at once from then on
+    std::atomic_bool stopped_ = false;
     int timerfd_;
     int timerctlfd_;
 
     size_t break_id_;
     size_t listen_id_;
+    size_t unix_listen_id_;
+    std::unique_ptr<DatagramSocket> datagram_socket_;
+    size_t datagram_id_;
+    internal::ExclusiveWrapper<std::deque<DatagramSocket::Datagram>, internal::SpinLock> datagram_queue_;
+    std::atomic<size_t> pending_datagrams_ = 0;
+    std::atomic_bool datagram_flush_scheduled_ = false;
+    // left by full socket buffer, loop thread only
+    std::deque<DatagramSocket::Datagram> datagram_backlog_;
     size_t timer_id_;
     size_t timerctl_id_;
 
     const int port_;
+    const std::optional<std::string> unix_path_;
+    const std::optional<size_t> shm_ring_size_;
+    const bool local_delivery_;
+    uint64_t resolved_subscription_;
+    const std::optional<size_t> zerocopy_threshold_;
+    const std::optional<std::chrono::microseconds> busy_poll_;
+    const std::optional<int> loop_cpu_;
+    const std::chrono::microseconds timer_slack_;
+    const std::optional<PoolPolicy> default_pool_policy_;
+    // some endpoints have pool policy, idle connections are being closed
+    std::atomic_bool autoscaling_ = false;
+    internal::ExclusiveWrapper<std::unordered_map<int, PoolPolicy>, internal::SpinLock> pool_overrides_;
+
+    const std::chrono::milliseconds connect_timeout_;
+    const std::chrono::milliseconds reconnect_backoff_;
+    const std::chrono::milliseconds max_reconnect_backoff_;
+
+    // endpoints which failed to connect
+    struct ReconnectState {
+        size_t failures = 0;
+        Clock::time_point retry_at;
+    };
+    internal::ExclusiveWrapper<std::unordered_map<int, ReconnectState>, internal::SpinLock> reconnect_;
+
+    const std::optional<size_t> connection_budget_;
+    std::atomic_bool eviction_scheduled_ = false;
+    internal::ExclusiveWrapper<std::unordered_map<int, std::shared_ptr<LocalRoute>>, internal::SpinLock> local_routes_;
     const size_t listener_backlog_;
 
     ConnectPool pool_;
     const size_t fixed_pool_size_;
 
-    internal::ExclusiveWrapper<std::unordered_map<int, std::queue<SharedView>>> pending_messages_;
+    internal::ExclusiveWrapper<std::unordered_map<int, PendingQueue>> pending_messages_;
 
     BufferPool& buffer_pool_;
     EndpointManager& endpoint_manager_;
 
     const size_t max_message_size_;
     const std::optional<size_t> max_pending_messages_;
+    const std::optional<size_t> max_pending_bytes_;
+    const bool frame_checksums_;
+    const bool datagrams_;
+    const size_t max_pending_datagrams_;
+
+    const std::optional<size_t> max_connection_inflight_bytes_;
+    const std::optional<size_t> max_inflight_bytes_;
+    std::atomic<size_t> inflight_bytes_ = 0;
+    // connections with paused reading, loop thread only
+    std::vector<uint64_t> paused_reads_;
+    // local messages held back by max_inflight_bytes, loop thread only. They take one place in paused_count_
+    std::deque<LocalMessage> paused_local_;
+    bool local_paused_ = false;
+    std::atomic<size_t> paused_count_ = 0;
+    std::atomic_bool resume_scheduled_ = false;
+    // gracefully closed zerocopy connections with sends not completed yet, loop thread only
+    std::unordered_map<uint64_t, std::shared_ptr<ConnData>> zerocopy_lingering_;
 
     bus::internal::ExclusiveWrapper<bus::internal::ActionMap, internal::SpinLock> action_map_;
+
+    Metrics metrics_registry_;
+    BusMetrics metrics_;
+    internal::ExclusiveWrapper<std::unordered_map<int, std::unique_ptr<EndpointMetrics>>, internal::SpinLock> endpoint_metrics_;
 };
 
 TcpBus::TcpBus(Options opts, BufferPool& buffer_pool, EndpointManager& endpoint_manager)
@@ -414,15 +1709,26 @@ TcpBus::TcpBus(Options opts, BufferPool& buffer_pool, EndpointManager& endpoint_
 {
 }
 
-void TcpBus::answer(uint64_t conn_id, SharedView buffer) {
-    impl_->answer(conn_id, std::move(buffer));
+bool TcpBus::answer(uint64_t conn_id, SharedView buffer) {
+    return impl_->answer(conn_id, std::move(buffer));
+}
+
+void TcpBus::release(uint64_t conn_id, size_t bytes) {
+    impl_->release(conn_id, bytes);
+}
+
+bool TcpBus::send_datagram(int endpoint, SharedView buffer) {
+    if (impl_->endpoint_manager_.transient(endpoint)) {
+        throw BusError("bad endpoint");
+    }
+    return impl_->send_datagram(endpoint, std::move(buffer));
 }
 
-bool TcpBus::send(int endpoint, SharedView buffer) {
+bool TcpBus::send(int endpoint, SharedView buffer, std::optional<Clock::time_point> deadline) {
     if (impl_->endpoint_manager_.transient(endpoint)) {
         throw BusError("bad endpoint");
     }
-    return impl_->send(endpoint, std::move(buffer));
+    return impl_->send(endpoint, std::move(buffer), deadline);
 }
 
 void TcpBus::clear_queue(int endpoint) {
@@ -437,28 +1743,49 @@ void TcpBus::set_greeter(std::function<std::optional<SharedView>(int endpoint)>
     impl_->greeter_ = std::move(greeter);
 }
 
+void TcpBus::set_drop_handler(std::function<void(int endpoint, SharedView)> handler) {
+    impl_->drop_handler_ = std::move(handler);
+}
+
+void TcpBus::set_pool_policy(int endpoint, PoolPolicy policy) {
+    (*impl_->pool_overrides_.get())[endpoint] = policy;
+    impl_->enable_autoscaling();
+}
+
 void TcpBus::rebind(uint64_t conn_id, int new_endpoint) {
     impl_->pool_.rebind(conn_id, new_endpoint);
+    if (auto data = impl_->pool_.select(conn_id)) {
+        data->metrics.store(&impl_->endpoint_metrics(new_endpoint), std::memory_order_release);
+    }
 }
 
 void TcpBus::close(uint64_t conn_id) {
     impl_->pool_.close(conn_id);
 }
 
+void TcpBus::enable_checksums(uint64_t conn_id) {
+    if (auto data = impl_->pool_.select(conn_id)) {
+        data->ingress_checksums.store(true, std::memory_order_relaxed);
+        data->egress_data.get()->checksums = true;
+    }
+}
+
+Metrics& TcpBus::metrics() {
+    return impl_->metrics_registry_;
+}
+
 void TcpBus::loop() {
     impl_->loop();
 }
 
 void TcpBus::to_break() {
+    impl_->stopped_.store(true);
     uint64_t val = 1;
     CHECK_ERRNO(write(impl_->breakfd_, &val, sizeof(val)) == sizeof(val));
 }
 
-void TcpBus::schedule_point(std::function<void()> what, std::chrono::time_point<std::chrono::system_clock> when) {
-    auto now = std::chrono::system_clock::now();
-    impl_->action_map_.get()->insert(when, std::move(what));
-    uint64_t val = 1;
-    CHECK_ERRNO(write(impl_->timerctlfd_, &val, sizeof(val)) == sizeof(val));
+void TcpBus::schedule_point(Task what, Clock::time_point when) {
+    impl_->schedule_at(when, std::move(what));
 }
 
 TcpBus::~TcpBus() = default;
@@ -4,26 +4,93 @@
 #include "endpoint_manager.h"
 #include "fwd.h"
 #include "executor.h"
+#include "metrics.h"
 
+#include <chrono>
 #include <functional>
+#include <limits>
 #include <memory>
 
 namespace bus {
 
 class TcpBus : public Executor {
 public:
+    // autoscaling of connections opened to an endpoint
+    struct PoolPolicy {
+        size_t min_connections = 1;
+        size_t max_connections = 6;
+        // one more connection is opened once send queue holds this many messages per connection
+        // for at least grow_after. Retiring connections don't count
+        size_t grow_queue_depth = 8;
+        std::chrono::microseconds grow_after = std::chrono::milliseconds(1);
+        // connections above min_connections which sent nothing for this long are closed
+        std::chrono::milliseconds idle_timeout = std::chrono::seconds(30);
+    };
+
     struct Options {
         int port = 80;
         size_t fixed_pool_size = 6;
         size_t listener_backlog = 60;
         size_t max_message_size = 4098;
         std::optional<size_t> max_pending_messages;
+        // limit on payload bytes queued per endpoint
+        std::optional<size_t> max_pending_bytes;
+        // additionally accept connections on this unix domain socket
+        std::optional<std::string> unix_path;
+        // connections to unix endpoints carry frames thru shared memory rings of this size.
+        // Rings are offered along with the greeter, so it requires set_greeter
+        std::optional<size_t> shm_ring_size;
+        // messages to loopback and unix endpoints served by a bus of this process (including self)
+        // are handed to its loop directly, if that bus has local_delivery enabled as well.
+        // Messages on the way count against max_pending_messages and max_pending_bytes, expire at deadline
+        // and wait while receiver is over max_inflight_bytes
+        bool local_delivery = false;
+        // tcp messages of at least this size are sent with MSG_ZEROCOPY,
+        // buffers stay referenced till the kernel reports completion
+        std::optional<size_t> zerocopy_threshold;
+        // loop keeps polling epoll without blocking for this long after the last event,
+        // tcp sockets get SO_BUSY_POLL of the same duration
+        std::optional<std::chrono::microseconds> busy_poll;
+        // cpu to pin the thread running loop() to
+        std::optional<int> loop_cpu;
+        // timer wakeups are rounded up to a multiple of slack, so that close timers fire together
+        std::chrono::microseconds timer_slack = std::chrono::microseconds::zero();
+        // replaces fixed_pool_size, see also set_pool_policy
+        std::optional<PoolPolicy> pool_policy;
+        // connection not established within this time counts as failed
+        std::chrono::milliseconds connect_timeout = std::chrono::seconds(3);
+        // endpoint which failed to connect is retried after jittered exponential backoff by a single connection.
+        // Till it succeeds the endpoint is down and sends to it are rejected
+        std::chrono::milliseconds reconnect_backoff = std::chrono::milliseconds(100);
+        std::chrono::milliseconds max_reconnect_backoff = std::chrono::seconds(30);
+        // reading from a connection pauses while handlers hold this many bytes delivered from it,
+        // or from all connections. Handlers then have to release() delivered messages
+        std::optional<size_t> max_connection_inflight_bytes;
+        std::optional<size_t> max_inflight_bytes;
+        // limit on connections of both directions, least recently used idle ones are closed above it.
+        // Queued messages stay and go out after reconnect. Defaults to RLIMIT_NOFILE less a reserve
+        std::optional<size_t> connection_budget;
+        // frames on outgoing connections carry crc32c of size and payload, after the greeter if there is one.
+        // Frames with bad checksum close the connection, so do frames without one once peer sent a checksum
+        // or asked for them. Peer has to run a version which verifies them
+        bool frame_checksums = false;
+        // udp socket on the same port for send_datagram, incoming datagrams go to the handler.
+        // Those from unknown addresses come with transient endpoint
+        bool datagrams = false;
+        size_t max_pending_datagrams = 4096;
     };
 
     struct ConnHandle {
         int endpoint;
         int socket;
         uint64_t conn_id;
+        // nonzero if message is sampled by trace
+        uint64_t trace_id = 0;
+
+        // local delivery has no connection behind it
+        static constexpr uint64_t kLocalConnId = std::numeric_limits<uint64_t>::max();
+        // neither do datagrams
+        static constexpr uint64_t kDatagramConnId = kLocalConnId - 1;
     };
 
 public:
@@ -32,18 +99,36 @@ public:
     void start(std::function<void(ConnHandle, SharedView)>);
 
     void clear_queue(int endpoint);
-    bool send(int endpoint, SharedView);
-    void answer(uint64_t conn_id, SharedView);
+    // message still queued at deadline is dropped and passed to drop handler
+    bool send(int endpoint, SharedView, std::optional<Clock::time_point> deadline = std::nullopt);
+    // fire and forget udp datagram, one per message. Fails for unix, unresolved endpoints and when queue is full
+    bool send_datagram(int endpoint, SharedView);
+    // queues message on the connection request came from, false if it is gone or local
+    bool answer(uint64_t conn_id, SharedView);
+    // handler is done with bytes delivered from connection, see Options::max_inflight_bytes
+    void release(uint64_t conn_id, size_t bytes);
+
+    // called on loop thread with messages dropped from queue
+    void set_drop_handler(std::function<void(int endpoint, SharedView)>);
 
     // greeter interface
     void set_greeter(std::function<std::optional<SharedView>(int endpoint)>);
     void close(uint64_t conn_id);
     void rebind(uint64_t conn_id, int new_endpoint);
+    // peer asked in greeter for checksums on frames sent back over its connection,
+    // its own frames without checksum are rejected from then on
+    void enable_checksums(uint64_t conn_id);
+
+    // per endpoint override of Options::pool_policy
+    void set_pool_policy(int endpoint, PoolPolicy policy);
 
     void loop();
+    // stops running loop(), later calls of loop() return at once
     void to_break();
 
-    void schedule_point(std::function<void()> what, std::chrono::time_point<std::chrono::system_clock> when) override;
+    Metrics& metrics();
+
+    void schedule_point(Task what, Clock::time_point when) override;
 
     ~TcpBus();
 
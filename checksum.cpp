@@ -0,0 +1,91 @@
+#include "checksum.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace bus::internal {
+
+namespace {
+
+constexpr uint32_t kPoly = 0x82f63b78;
+
+// slicing by 8: tables[k][b] is crc of byte b followed by k zero bytes
+constexpr std::array<std::array<uint32_t, 256>, 8> make_tables() {
+    std::array<std::array<uint32_t, 256>, 8> tables{};
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; ++i) {
+            crc = crc & 1 ? (crc >> 1) ^ kPoly : crc >> 1;
+        }
+        tables[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+        for (size_t k = 1; k < 8; ++k) {
+            tables[k][b] = (tables[k - 1][b] >> 8) ^ tables[0][tables[k - 1][b] & 255];
+        }
+    }
+    return tables;
+}
+
+constexpr auto kTables = make_tables();
+
+uint32_t update_portable(uint32_t crc, const unsigned char* p, size_t size) {
+    while (size >= 8) {
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24);
+        crc = kTables[7][lo & 255] ^ kTables[6][(lo >> 8) & 255] ^ kTables[5][(lo >> 16) & 255] ^ kTables[4][lo >> 24]
+            ^ kTables[3][p[4]] ^ kTables[2][p[5]] ^ kTables[1][p[6]] ^ kTables[0][p[7]];
+        p += 8;
+        size -= 8;
+    }
+    while (size--) {
+        crc = (crc >> 8) ^ kTables[0][(crc ^ *p++) & 255];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t update_sse42(uint32_t crc, const unsigned char* p, size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        size -= 8;
+    }
+    crc = crc64;
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+using Update = uint32_t (*)(uint32_t, const unsigned char*, size_t);
+
+Update select_update() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return update_sse42;
+    }
+#endif
+    return update_portable;
+}
+
+}
+
+uint32_t crc32c(const char* data, size_t size, uint32_t crc) {
+    static const Update update = select_update();
+    return ~update(~crc, reinterpret_cast<const unsigned char*>(data), size);
+}
+
+uint32_t crc32c_portable(const char* data, size_t size, uint32_t crc) {
+    return ~update_portable(~crc, reinterpret_cast<const unsigned char*>(data), size);
+}
+
+}
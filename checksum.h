@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace bus::internal {
+
+// crc32c (castagnoli), takes crc of preceding data to continue it.
+// Uses sse4.2 crc32 instruction if cpu has it
+uint32_t crc32c(const char* data, size_t size, uint32_t crc = 0);
+
+// table driven one, for tests and benchmarks
+uint32_t crc32c_portable(const char* data, size_t size, uint32_t crc = 0);
+
+}
@@ -15,6 +15,10 @@ SocketHolder::~SocketHolder() {
     if (sock_ < 0) {
         return;
     }
+    if (graceful_close_) {
+        close(sock_);
+        return;
+    }
     struct linger sl;
     sl.l_onoff = 1;
     sl.l_linger = 0;
@@ -42,14 +46,27 @@ public:
 
     void set_unavailable(uint64_t id) {
         if (auto data = select(id)) {
-            data->available_ = true;
+            data->available_ = false;
+            // splice relinks the node, iterator stays valid and nothing is allocated
             auto& d_list = by_endpoint_[data->endpoint];
-            auto it = d_list.insert(d_list.end(), id);
-            d_list.erase(data->by_endpoint_pos_);
-            data->by_endpoint_pos_ = it;
+            d_list.splice(d_list.end(), d_list, data->by_endpoint_pos_);
         }
     }
 
+    bool close(uint64_t id) {
+        auto it = by_id_.find(id);
+        if (it == by_id_.end()) {
+            return false;
+        }
+        by_endpoint_[it->second->endpoint].erase(it->second->by_endpoint_pos_);
+        by_usage_.erase(it->second->usage_list_pos_);
+        if (by_endpoint_[it->second->endpoint].empty()) {
+            by_endpoint_.erase(it->second->endpoint);
+        }
+        by_id_.erase(it);
+        return true;
+    }
+
 public:
     std::unordered_map<uint64_t, std::shared_ptr<PoolItem>> by_id_;
     std::unordered_map<int, std::list<uint64_t>> by_endpoint_;
@@ -91,8 +108,7 @@ std::shared_ptr<ConnData> ConnectPool::add(SocketHolder holder, uint64_t id, int
 std::shared_ptr<ConnData> ConnectPool::select(uint64_t id) {
     auto impl = impl_.get();
     if (auto data = impl->select(id)) {
-        impl->by_usage_.erase(data->usage_list_pos_);
-        data->usage_list_pos_ = impl->by_usage_.insert(impl->by_usage_.begin(), id);
+        impl->by_usage_.splice(impl->by_usage_.begin(), impl->by_usage_, data->usage_list_pos_);
         return data;
     } else {
         return nullptr;
@@ -141,15 +157,58 @@ void ConnectPool::set_available(uint64_t id) {
     if (auto data = impl->select(id)) {
         data->available_ = true;
         auto& d_list = impl->by_endpoint_[data->endpoint];
-        auto it = d_list.insert(d_list.begin(), id);
-        d_list.erase(data->by_endpoint_pos_);
-        data->by_endpoint_pos_ = it;
+        d_list.splice(d_list.begin(), d_list, data->by_endpoint_pos_);
+    }
+}
+
+void ConnectPool::retire(uint64_t id) {
+    auto impl = impl_.get();
+    if (auto data = impl->select(id); data && !data->retired.exchange(true)) {
+        impl->set_unavailable(id);
+        retired_.fetch_add(1, std::memory_order_seq_cst);
     }
 }
 
+size_t ConnectPool::count_retired_connections() {
+    return retired_.load(std::memory_order_seq_cst);
+}
+
 size_t ConnectPool::count_connections(int endpoint) {
     auto impl = impl_.get();
-    return impl->by_endpoint_[endpoint].size();
+    auto it = impl->by_endpoint_.find(endpoint);
+    if (it == impl->by_endpoint_.end()) {
+        return 0;
+    }
+    size_t result = 0;
+    for (uint64_t id : it->second) {
+        if (auto data = impl->select(id); data && !data->retired) {
+            ++result;
+        }
+    }
+    return result;
+}
+
+std::vector<int> ConnectPool::endpoints() {
+    auto impl = impl_.get();
+    std::vector<int> result;
+    result.reserve(impl->by_endpoint_.size());
+    for (auto& [endpoint, ids] : impl->by_endpoint_) {
+        result.push_back(endpoint);
+    }
+    return result;
+}
+
+std::vector<std::shared_ptr<ConnData>> ConnectPool::connections(int endpoint) {
+    auto impl = impl_.get();
+    std::vector<std::shared_ptr<ConnData>> result;
+    if (auto it = impl->by_endpoint_.find(endpoint); it != impl->by_endpoint_.end()) {
+        for (uint64_t id : it->second) {
+            if (auto data = impl->select(id)) {
+                result.push_back(std::move(data));
+            }
+        }
+    }
+    return result;
 }
 
 size_t ConnectPool::count_connections() {
@@ -158,31 +217,36 @@ size_t ConnectPool::count_connections() {
 
 void ConnectPool::close(uint64_t id) {
     auto impl = impl_.get();
-    auto it = impl->by_id_.find(id);
-    if (it != impl->by_id_.end()) {
-        impl->by_endpoint_[it->second->endpoint].erase(it->second->by_endpoint_pos_);
-        impl->by_usage_.erase(it->second->usage_list_pos_);
-        if (impl->by_endpoint_[it->second->endpoint].empty()) {
-            impl->by_endpoint_.erase(it->second->endpoint);
+    auto data = impl->select(id);
+    if (data && impl->close(id)) {
+        if (data->retired) {
+            retired_.fetch_sub(1, std::memory_order_seq_cst);
         }
-        impl->by_id_.erase(it);
+        size_.fetch_sub(1, std::memory_order_seq_cst);
     }
 }
 
-void ConnectPool::close_old_conns(size_t cnt) {
+std::vector<std::shared_ptr<ConnData>> ConnectPool::idle_lru(size_t cnt) {
     auto impl = impl_.get();
-    for (size_t i = 0; i < 2 && !impl->by_usage_.empty(); ++i) {
-        auto it = --(impl->by_usage_.end());
-        uint64_t id = *it;
-        close(id);
-
-        if (!impl->by_usage_.empty()) {
-            it =  --(impl->by_usage_.end());
-            if (id == *it) {
-                impl->by_usage_.erase(it);
-            }
+    std::vector<std::shared_ptr<ConnData>> result;
+    for (auto it = impl->by_usage_.rbegin(); it != impl->by_usage_.rend() && result.size() < cnt; ++it) {
+        auto data = impl->select(*it);
+        if (data && data->available_) {
+            result.push_back(std::move(data));
+        }
+    }
+    return result;
+}
+
+std::vector<std::shared_ptr<ConnData>> ConnectPool::retired_connections() {
+    auto impl = impl_.get();
+    std::vector<std::shared_ptr<ConnData>> result;
+    for (auto& [id, item] : impl->by_id_) {
+        if (item->retired) {
+            result.push_back(item);
         }
     }
+    return result;
 }
 
 ConnectPool::~ConnectPool() = default;
@@ -2,14 +2,19 @@
 
 #include "fwd.h"
 #include "buffer.h"
+#include "executor.h"
 #include "lock.h"
+#include "ring_deque.h"
+#include "shm_channel.h"
 #include "util.h"
 
 #include <atomic>
+#include <deque>
 #include <optional>
 #include <stdint.h>
 #include <cstddef>
 #include <utility>
+#include <vector>
 
 namespace bus {
 
@@ -39,19 +44,57 @@ public:
         return res;
     }
 
+    // close sends queued data and FIN rather than RST
+    void set_graceful_close(bool graceful = true) {
+        graceful_close_ = graceful;
+    }
+
+    bool graceful_close() const {
+        return graceful_close_;
+    }
+
 
     ~SocketHolder();
 
 private:
     int sock_ = kInvalidSocket;
+    bool graceful_close_ = false;
     static constexpr int kInvalidSocket = -1;
 };
 
+// per endpoint metrics of bus
+struct EndpointMetrics;
+
 struct ConnData {
+    // message referenced by a MSG_ZEROCOPY send, kept till the kernel reports completion
+    struct ZeroCopyBuffer {
+        uint32_t seq;
+        SharedView message;
+        char header[internal::header_len];
+    };
+
     struct EgressData {
         // doesn't include header
         std::optional<SharedView> message;
         uint64_t offset = 0;
+        uint64_t trace_id = 0;
+        // shm channel fds are to be passed with current message
+        bool shm_offer_pending = false;
+        // current message is greeter, it isn't resent on other connections
+        bool greeting = false;
+        // frames get crc32c, checksum of current message is computed once before its first byte is sent
+        bool checksums = false;
+        std::optional<uint32_t> checksum;
+        // answers to requests received on this connection, they go before endpoint queue.
+        // Empty whenever message is
+        internal::RingDeque<SharedView> answers;
+
+        // time of last dequeued message
+        Clock::time_point last_active;
+
+        // id of the next zerocopy send, kernel counts them per socket starting from zero
+        uint32_t zerocopy_seq = 0;
+        std::deque<ZeroCopyBuffer> zerocopy_pinned;
     };
 
     internal::ExclusiveWrapper<EgressData> egress_data;
@@ -59,11 +102,39 @@ struct ConnData {
     char ingress_header[internal::header_len];
     SharedView ingress_buf;
     size_t ingress_offset = 0;
+    // peer checksums its frames: it asked for them in greeter or sent one with checksum already.
+    // Frames without one are rejected from then on
+    std::atomic_bool ingress_checksums = false;
 
     SocketHolder socket;
 
+    // frames go thru shared memory, socket only tracks peer liveness.
+    // set by loop thread under egress_data lock
+    std::unique_ptr<ShmChannel> shm;
+    // accepted on unix socket, first frame may carry shm channel offer
+    bool accepts_shm_offer = false;
+    std::unique_ptr<ShmChannel> offered_shm;
+
+    // SO_ZEROCOPY is set on socket
+    bool zerocopy = false;
+    // opened by us rather than accepted
+    bool outgoing = false;
+    // outgoing connection waits for connect to complete
+    std::atomic_bool connecting = false;
+    // time of last received message, loop thread only
+    Clock::time_point last_read;
+    // delivered bytes not released by handlers yet
+    std::atomic<size_t> inflight_bytes = 0;
+    // loop thread only
+    bool reading_paused = false;
+    // idle connection is being closed: write side is shut down, so peer closes it once it reads everything.
+    // Set under egress_data lock, messages are left for other connections
+    std::atomic_bool retired = false;
+
     int endpoint;
     uint64_t id;
+    // metrics of endpoint, filled in by bus on first use and on rebind
+    std::atomic<EndpointMetrics*> metrics = nullptr;
 };
 
 class ConnectPool {
@@ -80,14 +151,24 @@ public:
     std::shared_ptr<ConnData> take_available(int endpoint);
 
     void set_available(uint64_t);
+    // takes connection out of rotation till it is closed, sets ConnData::retired
+    void retire(uint64_t);
 
+    // retired ones are going away and don't count
     size_t count_connections(int endpoint);
+    // retired ones included, they hold fds till closed
     size_t count_connections();
+    size_t count_retired_connections();
+
+    std::vector<int> endpoints();
+    std::vector<std::shared_ptr<ConnData>> connections(int endpoint);
 
     void rebind(uint64_t, int endpoint);
 
     void close(uint64_t);
-    void close_old_conns(size_t cnt);
+    // up to cnt least recently used connections which aren't writing
+    std::vector<std::shared_ptr<ConnData>> idle_lru(size_t cnt);
+    std::vector<std::shared_ptr<ConnData>> retired_connections();
 
     ~ConnectPool();
 
@@ -97,6 +178,7 @@ private:
 
     std::atomic<uint64_t> id_ = 0;
     std::atomic<uint64_t> size_ = 0;
+    std::atomic<uint64_t> retired_ = 0;
 };
 
 }
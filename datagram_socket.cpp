@@ -0,0 +1,193 @@
+#include "datagram_socket.h"
+
+#include "error.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <netinet/udp.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+namespace bus {
+
+namespace {
+
+constexpr size_t kBatch = 64;
+constexpr size_t kMaxSegments = 64;
+constexpr size_t kRecvBatch = 16;
+constexpr size_t kRecvSlot = 65536;
+constexpr size_t kControlSpace = CMSG_SPACE(sizeof(uint16_t));
+constexpr size_t kRecvControlSpace = CMSG_SPACE(sizeof(int));
+
+bool same_address(const sockaddr_in6& a, const sockaddr_in6& b) {
+    return a.sin6_port == b.sin6_port && memcmp(&a.sin6_addr, &b.sin6_addr, sizeof(a.sin6_addr)) == 0;
+}
+
+}
+
+DatagramSocket::DatagramSocket(SocketHolder sock)
+    : sock_(std::move(sock))
+{
+    int segment = 0;
+    socklen_t len = sizeof(segment);
+    gso_ = getsockopt(sock_.get(), SOL_UDP, UDP_SEGMENT, &segment, &len) == 0;
+    int on = 1;
+    gro_ = setsockopt(sock_.get(), SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+
+    send_msgs_.resize(kBatch);
+    send_iovs_.resize(kBatch * kMaxSegments);
+    send_control_.resize(kBatch * kControlSpace);
+    send_counts_.resize(kBatch);
+}
+
+DatagramSocket::~DatagramSocket() = default;
+
+DatagramSocket::Stats DatagramSocket::send(std::deque<Datagram>& queue) {
+    Stats stats;
+    while (!queue.empty()) {
+        size_t entries = 0;
+        size_t pos = 0;
+        size_t iovs = 0;
+        while (entries < kBatch && pos < queue.size()) {
+            auto& first = queue[pos];
+            size_t size = first.message.size();
+            size_t run = 1;
+            // kernel splits gso send into segments of equal size
+            if (gso_ && size > 0) {
+                while (run < kMaxSegments && pos + run < queue.size()
+                    && queue[pos + run].message.size() == size
+                    && (run + 1) * size <= kMaxPayload
+                    && same_address(queue[pos + run].addr, first.addr)) {
+                    ++run;
+                }
+            }
+            auto& msg = send_msgs_[entries];
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_hdr.msg_name = &first.addr;
+            msg.msg_hdr.msg_namelen = sizeof(first.addr);
+            msg.msg_hdr.msg_iov = &send_iovs_[iovs];
+            msg.msg_hdr.msg_iovlen = run;
+            for (size_t i = 0; i < run; ++i) {
+                auto& message = queue[pos + i].message;
+                send_iovs_[iovs++] = { .iov_base = message.data(), .iov_len = message.size() };
+            }
+            if (run > 1) {
+                char* control = &send_control_[entries * kControlSpace];
+                memset(control, 0, kControlSpace);
+                msg.msg_hdr.msg_control = control;
+                msg.msg_hdr.msg_controllen = kControlSpace;
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&msg.msg_hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segment = size;
+                memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+            }
+            send_counts_[entries++] = run;
+            pos += run;
+        }
+
+        int res = sendmmsg(sock_.get(), send_msgs_.data(), entries, MSG_DONTWAIT | MSG_NOSIGNAL);
+        ++stats.syscalls;
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return stats;
+            }
+            // e.g. no checksum offload on the route, datagrams are resent one by one
+            if (send_counts_[0] > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+                gso_ = false;
+                continue;
+            }
+            stats.errors += send_counts_[0];
+            queue.erase(queue.begin(), queue.begin() + send_counts_[0]);
+            continue;
+        }
+        size_t sent = 0;
+        for (int i = 0; i < res; ++i) {
+            sent += send_counts_[i];
+        }
+        stats.datagrams += sent;
+        queue.erase(queue.begin(), queue.begin() + sent);
+    }
+    return stats;
+}
+
+DatagramSocket::Stats DatagramSocket::receive(BufferPool& pool, size_t max_size, const std::function<void(const sockaddr_in6&, SharedView)>& handler) {
+    Stats stats;
+    if (recv_buf_.empty()) {
+        recv_buf_.resize(kRecvBatch * (kRecvSlot + kRecvControlSpace));
+    }
+    mmsghdr msgs[kRecvBatch];
+    iovec iovs[kRecvBatch];
+    sockaddr_in6 addrs[kRecvBatch];
+    while (true) {
+        for (size_t i = 0; i < kRecvBatch; ++i) {
+            char* slot = &recv_buf_[i * (kRecvSlot + kRecvControlSpace)];
+            iovs[i] = { .iov_base = slot, .iov_len = kRecvSlot };
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = slot + kRecvSlot;
+            msgs[i].msg_hdr.msg_controllen = kRecvControlSpace;
+        }
+        int res = recvmmsg(sock_.get(), msgs, kRecvBatch, MSG_DONTWAIT, nullptr);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // icmp errors of earlier sends are reported here as well, they are of no interest
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return stats;
+            }
+            ++stats.errors;
+            continue;
+        }
+        ++stats.syscalls;
+        for (int i = 0; i < res; ++i) {
+            auto& hdr = msgs[i].msg_hdr;
+            size_t len = msgs[i].msg_len;
+            if (hdr.msg_namelen != sizeof(sockaddr_in6) || (hdr.msg_flags & MSG_TRUNC)) {
+                ++stats.errors;
+                continue;
+            }
+            size_t segment = len;
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    int gro_segment;
+                    memcpy(&gro_segment, CMSG_DATA(cmsg), sizeof(gro_segment));
+                    segment = gro_segment;
+                }
+            }
+            const char* data = static_cast<const char*>(iovs[i].iov_base);
+            size_t offset = 0;
+            do {
+                size_t size = std::min(segment, len - offset);
+                if (size > max_size) {
+                    ++stats.errors;
+                } else {
+                    SharedView message(pool, size);
+                    memcpy(message.data(), data + offset, size);
+                    ++stats.datagrams;
+                    handler(addrs[i], std::move(message));
+                }
+                offset += size;
+            } while (offset < len && segment > 0);
+        }
+    }
+}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "buffer.h"
+#include "connect_pool.h"
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+namespace bus {
+
+// udp socket which batches datagrams into sendmmsg/recvmmsg calls.
+// Runs of equal sized datagrams to one address go as a single GSO send and
+// received GRO trains are split back, when the kernel supports them
+class DatagramSocket {
+public:
+    // largest udp payload over ipv6
+    static constexpr size_t kMaxPayload = 65527;
+
+    struct Datagram {
+        sockaddr_in6 addr;
+        SharedView message;
+    };
+
+    struct Stats {
+        size_t datagrams = 0;
+        size_t syscalls = 0;
+        // datagrams refused by kernel, e.g. too big for route
+        size_t errors = 0;
+    };
+
+public:
+    explicit DatagramSocket(SocketHolder sock);
+
+    DatagramSocket(const DatagramSocket&) = delete;
+
+    int fd() {
+        return sock_.get();
+    }
+
+    bool gso() const {
+        return gso_;
+    }
+
+    bool gro() const {
+        return gro_;
+    }
+
+    // sends from the front of queue till it is empty or socket buffer is full, failed datagrams are dropped
+    Stats send(std::deque<Datagram>& queue);
+
+    // reads till socket is drained, every datagram lands in its own pool slice
+    Stats receive(BufferPool& pool, size_t max_size, const std::function<void(const sockaddr_in6&, SharedView)>& handler);
+
+    ~DatagramSocket();
+
+private:
+    SocketHolder sock_;
+    bool gso_ = false;
+    bool gro_ = false;
+
+    // send batch, reused between calls
+    std::vector<mmsghdr> send_msgs_;
+    std::vector<iovec> send_iovs_;
+    std::vector<char> send_control_;
+    std::vector<size_t> send_counts_;
+
+    // receive slots are big enough for a GRO train
+    std::vector<char> recv_buf_;
+};
+
+}
@@ -3,88 +3,136 @@
 #include "future.h"
 #include "executor.h"
 #include "action_map.h"
+#include "task_queue.h"
+#include "util.h"
 
 
 #include <chrono>
-#include <condition_variable>
 #include <thread>
 
 
 namespace bus::internal {
 
 class DelayedExecutor : public Executor {
+private:
+    static constexpr size_t kImmediateCapacity = 1024;
+    // immediate tasks come in bursts, a short spin saves futex round trip on both sides
+    static constexpr auto kSpinBeforePark = std::chrono::microseconds(20);
+
 public:
-    DelayedExecutor()
-        : thread_(std::bind(&DelayedExecutor::execute, this))
+    // thread is pinned to cpu if one is given
+    DelayedExecutor(std::optional<int> cpu = std::nullopt)
+        : cpu_(cpu)
+        , immediate_(kImmediateCapacity)
+        , thread_(std::bind(&DelayedExecutor::execute, this))
     {
     }
 
     DelayedExecutor(const DelayedExecutor&) = delete;
     DelayedExecutor(DelayedExecutor&&) = delete;
 
-    void schedule_point(std::function<void()> what, std::chrono::time_point<std::chrono::system_clock> when) override {
-        actions_.get()->insert(when, std::move(what));
-        ready_.notify();
+    // due tasks skip the timer map, they go to the run queue unless it is full
+    void schedule_point(Task what, Clock::time_point when) override {
+        if (when > Clock::now() || !immediate_.try_push(what)) {
+            actions_.get()->insert(when, std::move(what));
+        }
+        wake();
     }
 
     ~DelayedExecutor() {
         shot_down_.store(true);
-        ready_.notify();
+        wake();
         shot_down_event_.wait();
 
         thread_.join();
     }
 
 private:
+    // syscall only if executor is parked, pairs with fence in execute
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked_.load(std::memory_order_relaxed) && parked_.exchange(0)) {
+            futex_wake(parked_);
+        }
+    }
+
     void execute() {
+        if (cpu_) {
+            pin_thread(*cpu_);
+        }
         while (!shot_down_.load()) {
-            std::optional<std::chrono::system_clock::time_point> wait_until;
+            Task to_execute;
+            for (size_t i = 0; i < kImmediateCapacity && immediate_.try_pop(to_execute); ++i) {
+                to_execute();
+                to_execute = nullptr;
+            }
 
-            auto now = std::chrono::system_clock::now();
-            ready_.reset();
+            auto now = Clock::now();
             while (true) {
-                std::function<void()> to_execute;
                 {
                     auto actions = actions_.get();
-                    if (auto next = actions->next_time_point()) {
-                        if (*next <= now) {
-                            to_execute = actions->pick_action();
-                        } else {
-                            wait_until = next;
-                        }
+                    if (auto next = actions->next_time_point(); next && *next <= now) {
+                        to_execute = actions->pick_action();
                     }
                 }
                 if (to_execute) {
                     to_execute();
+                    to_execute = nullptr;
                 } else {
                     break;
                 }
             }
 
-            if (shot_down_.load()) {
-                break;
+            // on a single cpu spinning only delays producers, yield lets them fill the queue instead
+            auto spin_until = Clock::now() + kSpinBeforePark;
+            while (immediate_.empty() && !shot_down_.load(std::memory_order_relaxed) && Clock::now() < spin_until) {
+                if (multicore_) {
+                    cpu_relax();
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+            if (!immediate_.empty()) {
+                continue;
             }
+
+            parked_.store(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (shot_down_.load() || !immediate_.empty()) {
+                parked_.store(0, std::memory_order_relaxed);
+                continue;
+            }
+            // timer could be added after the loop above
+            auto wait_until = actions_.get()->next_time_point();
             if (wait_until) {
-                ready_.wait_until(*wait_until);
+                now = Clock::now();
+                if (*wait_until > now) {
+                    futex_wait(parked_, 1, *wait_until - now);
+                }
             } else {
-                ready_.wait();
+                futex_wait(parked_, 1);
             }
+            parked_.store(0, std::memory_order_relaxed);
         }
         shot_down_event_.notify();
     }
 
 private:
     internal::ExclusiveWrapper<ActionMap, std::recursive_mutex> actions_;
-    Event ready_;
     std::atomic_bool shot_down_ = false;
     Event shot_down_event_;
+    const std::optional<int> cpu_;
+    TaskQueue immediate_;
+    const bool multicore_ = std::thread::hardware_concurrency() > 1;
+    // 1 while executor thread sleeps or is about to
+    std::atomic<uint32_t> parked_ = 0;
     std::thread thread_;
 };
 
 class PeriodicExecutor {
 public:
     template<typename Duration>
-    PeriodicExecutor(std::function<void()> f, Duration period)
+    PeriodicExecutor(Task f, Duration period)
         : f_(std::move(f))
         , period_(std::chrono::duration_cast<decltype(period_)>(period))
     {
@@ -93,7 +141,7 @@ public:
     }
 
     template<typename Duration>
-    PeriodicExecutor(std::function<void()> f, Duration period, Executor& executor)
+    PeriodicExecutor(Task f, Duration period, Executor& executor)
         : f_(std::move(f))
         , period_(std::chrono::duration_cast<decltype(period_)>(period))
     {
@@ -123,8 +171,8 @@ private:
     }
 
 private:
-    std::function<void()> f_;
-    std::chrono::system_clock::duration period_;
+    Task f_;
+    Clock::duration period_;
 
     Executor* backend_;
     std::unique_ptr<DelayedExecutor> executor_holder_;
@@ -1,34 +1,27 @@
 #include "endpoint_manager.h"
 
+#include "address_map.h"
+#include "delayed_executor.h"
 #include "error.h"
 #include "lock.h"
 
 #include <sstream>
 #include <cstring>
+#include <map>
 #include <unordered_map>
 #include <vector>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
+#include <unistd.h>
 
 namespace bus {
 
-struct SockaddrHash {
-    size_t operator()(const sockaddr_in6& addr) const {
-        std::string_view view(reinterpret_cast<const char*>(&addr), sizeof(addr));
-        return std::hash<std::string_view>()(view);
-    }
-};
-
-struct SockaddrCompare {
-    bool operator() (const sockaddr_in6& addr1, const sockaddr_in6& addr2) const {
-        return memcmp(&addr1, &addr2, sizeof(struct sockaddr_in6)) == 0;
-    }
-};
-
 void set_nodelay(int socket) {
   int flags = 1;
   CHECK_ERRNO(
@@ -37,33 +30,235 @@ void set_nodelay(int socket) {
 
 constexpr int v6_unbound = -1;
 
+sockaddr_un unix_address(const std::string& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw BusError("too long unix socket path");
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+    return addr;
+}
+
+// names are resolved to v6 addresses, v4 ones are v4-mapped, so that dual stack sockets reach them
+std::vector<sockaddr_in6> lookup(const std::string& host, int port, bool numeric_only) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = numeric_only ? AI_NUMERICHOST : 0;
+    struct addrinfo* info;
+    int res = getaddrinfo(host.c_str(), nullptr, &hints, &info);
+    if (res != 0) {
+        throw BusError(gai_strerror(res));
+    }
+    std::vector<sockaddr_in6> result;
+    for (addrinfo* i = info; i != nullptr; i = i->ai_next) {
+        sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        if (i->ai_family == AF_INET6) {
+            addr = *reinterpret_cast<sockaddr_in6*>(i->ai_addr);
+        } else if (i->ai_family == AF_INET) {
+            auto& addr4 = *reinterpret_cast<sockaddr_in*>(i->ai_addr);
+            addr.sin6_addr.s6_addr[10] = 0xff;
+            addr.sin6_addr.s6_addr[11] = 0xff;
+            memcpy(&addr.sin6_addr.s6_addr[12], &addr4.sin_addr, sizeof(addr4.sin_addr));
+        } else {
+            continue;
+        }
+        addr.sin6_port = htons(port);
+        result.push_back(addr);
+    }
+    freeaddrinfo(info);
+    if (result.empty()) {
+        throw BusError("no suitable address found");
+    }
+    return result;
+}
+
+sockaddr_in6 loopback_address(int port) {
+    sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_loopback;
+    addr.sin6_port = htons(port);
+    return addr;
+}
+
+bool is_loopback(const sockaddr_in6& addr) {
+    if (IN6_IS_ADDR_LOOPBACK(&addr.sin6_addr)) {
+        return true;
+    }
+    // v4-mapped 127.0.0.0/8
+    return IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr) && addr.sin6_addr.s6_addr[12] == 127;
+}
+
 class EndpointManager::Impl {
 public:
-    void async_connect(SocketHolder& sock, int endpoint) {
-        sockaddr_in6 addr;
+    // either sockaddr_in6 or sockaddr_un, empty while endpoint is being resolved
+    struct Address {
+        sockaddr_storage addr;
+        socklen_t len = 0;
+
+        int family() const {
+            return len > 0 ? addr.ss_family : AF_UNSPEC;
+        }
+    };
+
+    struct CachedName {
+        std::vector<sockaddr_in6> addrs;
+        Clock::time_point expires;
+    };
+
+public:
+    Impl(Options opts)
+        : opts_(opts)
+    {
+    }
+
+    // cached getaddrinfo, called without state lock
+    std::vector<sockaddr_in6> lookup_cached(const std::string& host, int port) {
+        auto now = Clock::now();
         {
-            auto state = state_.get();
-            if (endpoint > state->endpoints_.size()) {
-                throw BusError("invalid endpoint");
+            auto cache = cache_.get();
+            if (auto it = cache->find(host); it != cache->end() && it->second.expires > now) {
+                auto result = it->second.addrs;
+                for (auto& addr : result) {
+                    addr.sin6_port = htons(port);
+                }
+                return result;
             }
-            addr = state->endpoints_[endpoint];
         }
+        auto result = lookup(host, port, false);
+        (*cache_.get())[host] = CachedName{ .addrs = result, .expires = now + opts_.resolve_ttl };
+        return result;
+    }
 
-        int status = connect(sock.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(sockaddr_in6));
-        CHECK_ERRNO(status == 0 || errno == EINPROGRESS || errno == EINTR);
-        set_nodelay(sock.get());
+    // binds endpoint to the first address, the rest of them resolve to endpoint as well.
+    // Concurrent resolutions are published by one thread in a single update
+    void apply(int endpoint, std::vector<sockaddr_in6> addrs) {
+        resolved_.get()->push_back({ endpoint, std::move(addrs) });
+        while (!publishing_.exchange(true, std::memory_order_acquire)) {
+            std::vector<std::pair<int, std::vector<sockaddr_in6>>> resolved;
+            std::swap(resolved, *resolved_.get());
+            std::vector<int> changed;
+            if (!resolved.empty()) {
+                state_.update([&] (State& state) {
+                        changed.clear();
+                        for (auto& [endpoint, addrs] : resolved) {
+                            auto& current = state.endpoints_[endpoint];
+                            if (current.len != sizeof(sockaddr_in6) || memcmp(&current.addr, &addrs[0], sizeof(sockaddr_in6)) != 0) {
+                                changed.push_back(endpoint);
+                            }
+                            state.set(endpoint, addrs[0]);
+                            for (auto& addr : addrs) {
+                                state.resolve_map_.insert_or_assign(addr, endpoint);
+                            }
+                        }
+                    });
+            }
+            for (int endpoint : changed) {
+                notify(endpoint);
+            }
+            publishing_.store(false, std::memory_order_release);
+            // results pushed while we were publishing
+            if (resolved_.get()->empty()) {
+                return;
+            }
+        }
     }
 
-    int resolve(int sock, int port) {
-        sockaddr_in6 addr;
+    void notify(int endpoint) {
+        auto subscribers = subscribers_.get();
+        for (auto& [id, callback] : *subscribers) {
+            callback(endpoint);
+        }
+    }
+
+    void resolve_in_background(int endpoint, std::string host, int port, Clock::duration delay) {
+        resolver().schedule([=] {
+                try {
+                    apply(endpoint, lookup_cached(host, port));
+                    resolve_in_background(endpoint, host, port, opts_.resolve_ttl);
+                } catch (const BusError&) {
+                    resolve_in_background(endpoint, host, port, opts_.retry_interval);
+                }
+            }, delay);
+    }
+
+    internal::DelayedExecutor& resolver() {
+        auto resolvers = resolvers_.get();
+        if (resolvers->empty()) {
+            for (size_t i = 0; i < std::max<size_t>(opts_.resolver_threads, 1); ++i) {
+                resolvers->push_back(std::make_unique<internal::DelayedExecutor>());
+            }
+        }
+        return *(*resolvers)[next_resolver_++ % resolvers->size()];
+    }
+
+    Address address(int endpoint) {
+        auto state = state_.read();
+        if (endpoint < 0 || endpoint >= state->endpoints_.size()) {
+            throw BusError("invalid endpoint");
+        }
+        return state->endpoints_[endpoint];
+    }
+
+    void async_connect(SocketHolder& sock, int endpoint) {
+        Address addr = address(endpoint);
+
+        int status = connect(sock.get(), reinterpret_cast<sockaddr*>(&addr.addr), addr.len);
+        CHECK_ERRNO(status == 0 || errno == EINPROGRESS || errno == EINTR || (addr.family() == AF_UNIX && errno == EAGAIN));
+        if (addr.family() == AF_INET6) {
+            set_nodelay(sock.get());
+        }
+    }
+
+    int resolve(int sock, int port, const std::string& unix_path) {
+        sockaddr_storage addr;
         socklen_t addrlen = sizeof(addr);
         int res = getpeername(sock, reinterpret_cast<struct sockaddr*>(&addr), &addrlen);
-        if (res != 0 || addrlen != sizeof(addr) || addr.sin6_family != AF_INET6) {
+        if (res != 0) {
+            return v6_unbound;
+        }
+        // peers of unix sockets are unnamed, so they are identified by their listen path.
+        // Peer that doesn't listen on unix socket is on this host, it is reached at loopback
+        if (addr.ss_family == AF_UNIX) {
+            if (!unix_path.empty()) {
+                return resolve_unix(unix_path);
+            }
+            return port > 0 ? resolve(loopback_address(port)) : v6_unbound;
+        }
+        if (addrlen != sizeof(sockaddr_in6) || addr.ss_family != AF_INET6) {
             return v6_unbound;
-        } else {
-            addr.sin6_port = htons(port);
-            return state_.get()->resolve(&addr);
         }
+        auto& addr6 = reinterpret_cast<sockaddr_in6&>(addr);
+        addr6.sin6_port = htons(port);
+        return resolve(addr6);
+    }
+
+    bool local_peer(int sock) {
+        sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        int res = getpeername(sock, reinterpret_cast<struct sockaddr*>(&addr), &addrlen);
+        if (res != 0) {
+            return false;
+        }
+        return addr.ss_family == AF_UNIX
+            || (addr.ss_family == AF_INET6 && is_loopback(reinterpret_cast<sockaddr_in6&>(addr)));
+    }
+
+    void upgrade_to_unix(int endpoint, const std::string& path) {
+        state_.update([&] (State& state) {
+                if (endpoint < 0 || endpoint >= state.endpoints_.size()) {
+                    throw BusError("invalid endpoint");
+                }
+                state.set_unix(endpoint, path);
+            });
+        notify(endpoint);
     }
 
     EndpointManager::IncomingConnection accept(int listensock) {
@@ -80,75 +275,283 @@ public:
 
 public:
     struct State {
-        std::unordered_map<sockaddr_in6, int, SockaddrHash, SockaddrCompare> resolve_map_;
-        std::vector<sockaddr_in6> endpoints_;
+        internal::AddressMap<> resolve_map_;
+        std::unordered_map<std::string, int> unix_resolve_map_;
+        // names of register_endpoints
+        std::map<std::pair<std::string, int>, int> name_map_;
+        std::vector<Address> endpoints_;
 
-        int resolve(sockaddr_in6* addr) {
-            if (resolve_map_.find(*addr) != resolve_map_.end()) {
-                return resolve_map_[*addr];
+        int resolve(const sockaddr_in6& addr) {
+            if (auto endpoint = resolve_map_.find(addr)) {
+                return *endpoint;
             }
             int result = endpoints_.size();
-            resolve_map_[*addr] = result;
-            if (result >= endpoints_.size()) {
-                endpoints_.resize(result + 1);
+            resolve_map_.insert_or_assign(addr, result);
+            set(result, addr);
+            return result;
+        }
+
+        int resolve_unix(const std::string& path) {
+            if (auto it = unix_resolve_map_.find(path); it != unix_resolve_map_.end()) {
+                return it->second;
             }
-            endpoints_[result] = *addr;
+            int result = endpoints_.size();
+            set_unix(result, path);
             return result;
         }
+
+        void set(int endpoint, const sockaddr_in6& addr) {
+            endpoints_.resize(std::max<size_t>(endpoints_.size(), endpoint + 1));
+            memcpy(&endpoints_[endpoint].addr, &addr, sizeof(addr));
+            endpoints_[endpoint].len = sizeof(addr);
+        }
+
+        void set_unix(int endpoint, const std::string& path) {
+            sockaddr_un addr = unix_address(path);
+            endpoints_.resize(std::max<size_t>(endpoints_.size(), endpoint + 1));
+            memcpy(&endpoints_[endpoint].addr, &addr, sizeof(addr));
+            endpoints_[endpoint].len = sizeof(addr);
+            unix_resolve_map_[path] = endpoint;
+        }
     };
-    internal::ExclusiveWrapper<State> state_;
+    // known addresses are looked up without locks, registration takes the writer lock
+    int resolve(const sockaddr_in6& addr) {
+        if (auto endpoint = state_.read()->resolve_map_.find(addr)) {
+            return *endpoint;
+        }
+        int result;
+        state_.update([&] (State& state) { result = state.resolve(addr); });
+        return result;
+    }
+
+    int resolve_unix(const std::string& path) {
+        {
+            auto state = state_.read();
+            if (auto it = state->unix_resolve_map_.find(path); it != state->unix_resolve_map_.end()) {
+                return it->second;
+            }
+        }
+        int result;
+        state_.update([&] (State& state) { result = state.resolve_unix(path); });
+        return result;
+    }
+
+    internal::LeftRightWrapper<State> state_;
+
+    const Options opts_;
+    internal::ExclusiveWrapper<std::unordered_map<std::string, CachedName>> cache_;
+    internal::ExclusiveWrapper<std::map<uint64_t, std::function<void(int)>>> subscribers_;
+    uint64_t next_subscription_ = 0;
+
+    internal::ExclusiveWrapper<std::vector<std::pair<int, std::vector<sockaddr_in6>>>, internal::SpinLock> resolved_;
+    std::atomic_bool publishing_ = false;
+
+    std::atomic<size_t> next_resolver_ = 0;
+    // last member, so that resolver threads are joined before the rest is destroyed
+    internal::ExclusiveWrapper<std::vector<std::unique_ptr<internal::DelayedExecutor>>> resolvers_;
 };
 
 EndpointManager::EndpointManager()
-    : impl_(new Impl())
+    : EndpointManager(Options{})
+{
+}
+
+EndpointManager::EndpointManager(Options opts)
+    : impl_(new Impl(opts))
 {
 }
 
+std::vector<int> EndpointManager::register_endpoints(const std::vector<std::pair<std::string, int>>& addrs) {
+    // literal addresses are parsed in place
+    std::vector<std::optional<std::vector<sockaddr_in6>>> numeric(addrs.size());
+    for (size_t i = 0; i < addrs.size(); ++i) {
+        if (addrs[i].first.rfind(kUnixPrefix, 0) == 0) {
+            continue;
+        }
+        try {
+            numeric[i] = lookup(addrs[i].first, addrs[i].second, true);
+        } catch (const BusError&) {
+        }
+    }
+
+    // all of them are published in one update
+    std::vector<int> result(addrs.size());
+    std::vector<size_t> to_resolve;
+    impl_->state_.update([&] (Impl::State& state) {
+            to_resolve.clear();
+            for (size_t i = 0; i < addrs.size(); ++i) {
+                auto& [host, port] = addrs[i];
+                if (host.rfind(kUnixPrefix, 0) == 0) {
+                    result[i] = state.resolve_unix(host.substr(kUnixPrefix.size()));
+                } else if (numeric[i]) {
+                    result[i] = state.resolve(numeric[i]->front());
+                    for (auto& addr : *numeric[i]) {
+                        state.resolve_map_.insert_or_assign(addr, result[i]);
+                    }
+                } else {
+                    auto [it, inserted] = state.name_map_.insert({ { host, port }, static_cast<int>(state.endpoints_.size()) });
+                    result[i] = it->second;
+                    if (inserted) {
+                        state.endpoints_.resize(result[i] + 1);
+                        to_resolve.push_back(i);
+                    }
+                }
+            }
+        });
+    for (size_t i : to_resolve) {
+        impl_->resolve_in_background(result[i], addrs[i].first, addrs[i].second, Clock::duration::zero());
+    }
+    return result;
+}
+
+bool EndpointManager::resolved(int endpoint) {
+    auto state = impl_->state_.read();
+    return endpoint >= 0 && endpoint < state->endpoints_.size() && state->endpoints_[endpoint].len > 0;
+}
+
+uint64_t EndpointManager::subscribe_resolved(std::function<void(int)> callback) {
+    auto subscribers = impl_->subscribers_.get();
+    uint64_t id = impl_->next_subscription_++;
+    (*subscribers)[id] = std::move(callback);
+    return id;
+}
+
+void EndpointManager::unsubscribe_resolved(uint64_t subscription) {
+    impl_->subscribers_.get()->erase(subscription);
+}
+
 int EndpointManager::add_address(std::string addr, int port, std::optional<int> merge_to) {
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET6;
-    hints.ai_protocol = IPPROTO_TCP;
-    struct addrinfo* info;
-    int res = getaddrinfo(addr.c_str(), nullptr, &hints, &info);
-    if (res != 0) {
-        throw BusError(gai_strerror(res));
+    if (addr.rfind(kUnixPrefix, 0) == 0) {
+        std::string path = addr.substr(kUnixPrefix.size());
+        if (!merge_to) {
+            return impl_->resolve_unix(path);
+        }
+        impl_->state_.update([&] (Impl::State& state) { state.set_unix(*merge_to, path); });
+        impl_->notify(*merge_to);
+        return *merge_to;
     }
-    std::optional<int> result = merge_to;
-    auto state = impl_->state_.get();
-    for (addrinfo* i = info; i != nullptr; i = i->ai_next) {
-        if (info->ai_family == AF_INET6) {
-            sockaddr_in6 addr = *reinterpret_cast<sockaddr_in6*>(info->ai_addr);
-            addr.sin6_port = htons(port);
+
+    // state isn't locked while resolving
+    auto addrs = impl_->lookup_cached(addr, port);
+    std::optional<int> result;
+    // binds endpoint to the first address, the rest of them resolve to endpoint as well, as in apply
+    impl_->state_.update([&] (Impl::State& state) {
+            result = merge_to;
             if (!result) {
-                result = state->resolve(&addr);
+                result = state.resolve(addrs.front());
             } else {
-                state->endpoints_.resize(std::max<size_t>(state->endpoints_.size(), *result + 1));
-                state->endpoints_[*result] = addr;
+                state.set(*result, addrs.front());
             }
-            state->resolve_map_[addr] = result.value();
-        }
-    }
-    freeaddrinfo(info);
-    if (!result.has_value()) {
-        throw BusError("no suitable address found");
+            for (auto& addr : addrs) {
+                state.resolve_map_.insert_or_assign(addr, result.value());
+            }
+        });
+    if (merge_to) {
+        impl_->notify(*merge_to);
     }
     return result.value();
+}
+
+SocketHolder EndpointManager::socket(int endpoint) {
+    int family = impl_->address(endpoint).family();
+    if (family == AF_UNSPEC) {
+        throw BusError("endpoint is not resolved yet");
+    }
+    SocketHolder sock = ::socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    CHECK_ERRNO(sock.get() >= 0);
+    return sock;
+}
 
+SocketHolder EndpointManager::listen_unix(const std::string& path, size_t backlog) {
+    sockaddr_un addr = unix_address(path);
+    SocketHolder sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    CHECK_ERRNO(sock.get() >= 0);
+    // stale socket file left by previous run, anything else at the path is not ours to remove
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            throw BusError("unix socket path is taken by a non-socket file");
+        }
+        CHECK_ERRNO(unlink(path.c_str()) == 0 || errno == ENOENT);
+    } else {
+        CHECK_ERRNO(errno == ENOENT);
+    }
+    CHECK_ERRNO(bind(sock.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+    CHECK_ERRNO(listen(sock.get(), backlog) == 0);
+    return sock;
 }
 
-SocketHolder EndpointManager::socket(int) {
-    SocketHolder sock = ::socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+SocketHolder EndpointManager::listen_datagram(int port) {
+    SocketHolder sock = ::socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     CHECK_ERRNO(sock.get() >= 0);
+    int optval = 1;
+    setsockopt(sock.get(), SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+    sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    CHECK_ERRNO(bind(sock.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
     return sock;
 }
 
+std::optional<sockaddr_in6> EndpointManager::datagram_address(int endpoint) {
+    auto addr = impl_->address(endpoint);
+    if (addr.family() != AF_INET6) {
+        return std::nullopt;
+    }
+    return reinterpret_cast<sockaddr_in6&>(addr.addr);
+}
+
+int EndpointManager::find(const sockaddr_in6& addr) {
+    if (auto endpoint = impl_->state_.read()->resolve_map_.find(addr)) {
+        return *endpoint;
+    }
+    return v6_unbound;
+}
+
+bool EndpointManager::unix_endpoint(int endpoint) {
+    return impl_->address(endpoint).family() == AF_UNIX;
+}
+
+std::optional<int> EndpointManager::loopback_port(int endpoint) {
+    auto addr = impl_->address(endpoint);
+    if (addr.family() != AF_INET6) {
+        return std::nullopt;
+    }
+    auto& addr6 = reinterpret_cast<sockaddr_in6&>(addr.addr);
+    if (!is_loopback(addr6)) {
+        return std::nullopt;
+    }
+    return ntohs(addr6.sin6_port);
+}
+
+std::optional<std::string> EndpointManager::unix_path(int endpoint) {
+    auto addr = impl_->address(endpoint);
+    if (addr.family() != AF_UNIX) {
+        return std::nullopt;
+    }
+    return std::string(reinterpret_cast<sockaddr_un&>(addr.addr).sun_path);
+}
+
+int EndpointManager::resolve_loopback(int port) {
+    return impl_->resolve(loopback_address(port));
+}
+
+bool EndpointManager::local_peer(int sock) {
+    return impl_->local_peer(sock);
+}
+
+void EndpointManager::upgrade_to_unix(int endpoint, const std::string& path) {
+    impl_->upgrade_to_unix(endpoint, path);
+}
+
 void EndpointManager::async_connect(SocketHolder& sock, int endpoint) {
     impl_->async_connect(sock, endpoint);
 }
 
-int EndpointManager::resolve(int sock, int port) {
-    return impl_->resolve(sock, port);
+int EndpointManager::resolve(int sock, int port, const std::string& unix_path) {
+    return impl_->resolve(sock, port, unix_path);
 }
 
 EndpointManager::IncomingConnection EndpointManager::accept(int listen_socket) {
@@ -4,15 +4,24 @@
 
 #include "connect_pool.h"
 
+#include <netinet/in.h>
 #include <sys/socket.h>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace bus {
 
 class EndpointManager {
 public:
     static constexpr int unbound_v6 = -1;
+    // register_endpoint("unix:/path/to/socket", port) registers unix domain socket endpoint, port is ignored
+    static constexpr std::string_view kUnixPrefix = "unix:";
 
     struct IncomingConnection {
         SocketHolder sock_;
@@ -20,8 +29,17 @@ public:
         int endpoint_;
     };
 
+    struct Options {
+        // threads resolving names of register_endpoints, spawned on first use
+        size_t resolver_threads = 4;
+        // resolved names are cached for ttl, names registered with register_endpoints are re-resolved as often
+        std::chrono::seconds resolve_ttl = std::chrono::seconds(60);
+        std::chrono::milliseconds retry_interval = std::chrono::seconds(1);
+    };
+
 public:
     EndpointManager();
+    explicit EndpointManager(Options opts);
 
     int register_endpoint(std::string addr, int port) {
         return add_address(addr, port, std::nullopt);
@@ -31,6 +49,17 @@ public:
         add_address(addr, port, merge_to);
     }
 
+    // returns ids at once, names are resolved in parallel in background.
+    // Until then endpoints are not resolved, messages to them wait in send queues
+    std::vector<int> register_endpoints(const std::vector<std::pair<std::string, int>>& addrs);
+
+    // address of endpoint is known, false for endpoints of register_endpoints which are still being resolved
+    bool resolved(int endpoint);
+
+    // callback is invoked once endpoint gets a new address, by resolver thread or the one which changed it
+    uint64_t subscribe_resolved(std::function<void(int)> callback);
+    void unsubscribe_resolved(uint64_t subscription);
+
     SocketHolder socket(int endpoint);
     void async_connect(SocketHolder& sock, int endpoint);
     IncomingConnection accept(int listen_socket);
@@ -39,7 +68,32 @@ public:
         return endpoint < 0;
     }
 
-    int resolve(int sock, int port);
+    bool unix_endpoint(int endpoint);
+
+    // port of loopback endpoint or path of unix one, these could be served by this very process
+    std::optional<int> loopback_port(int endpoint);
+    std::optional<std::string> unix_path(int endpoint);
+    // endpoint of ::1 with given port
+    int resolve_loopback(int port);
+
+    // unix_path identifies peers connected over unix domain socket, peers without one are resolved to ::1 and port
+    int resolve(int sock, int port, const std::string& unix_path = {});
+
+    // replaces stale socket file at path, fails if path is taken by a file of other type
+    SocketHolder listen_unix(const std::string& path, size_t backlog);
+    // udp socket bound to port on all addresses
+    SocketHolder listen_datagram(int port);
+
+    // datagrams go to the same address and port as connections, none for unix and unresolved endpoints
+    std::optional<sockaddr_in6> datagram_address(int endpoint);
+    // known endpoint of the address, e.g. of datagram source, unbound_v6 otherwise.
+    // Unlike resolve it never registers a new endpoint
+    int find(const sockaddr_in6& addr);
+
+    // peer is connected over unix socket or loopback
+    bool local_peer(int sock);
+    // further connections to endpoint use unix domain socket
+    void upgrade_to_unix(int endpoint, const std::string& path);
 
     ~EndpointManager();
 
@@ -1,21 +1,24 @@
 #pragma once
 
 #include "lock.h"
+#include "task.h"
 
 #include <chrono>
-#include <functional>
 
 namespace bus {
 
+// timers are monotonic, wall clock adjustments don't affect them
+using Clock = std::chrono::steady_clock;
+
 class Executor {
 public:
     template<typename Duration>
-    void schedule(std::function<void()> what, Duration when) {
-        auto deadline = std::chrono::time_point_cast<std::chrono::system_clock::time_point::duration>(std::chrono::system_clock::now() + when);
+    void schedule(Task what, Duration when) {
+        auto deadline = std::chrono::time_point_cast<Clock::duration>(Clock::now() + when);
         schedule_point(std::move(what), deadline);
     }
 
-    virtual void schedule_point(std::function<void()> what, std::chrono::time_point<std::chrono::system_clock> when) = 0;
+    virtual void schedule_point(Task what, Clock::time_point when) = 0;
 
     virtual ~Executor() = default;
 };
@@ -1,11 +1,14 @@
 #pragma once
 
+#include "pool_allocator.h"
+#include "task.h"
+
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <atomic>
 #include <optional>
 #include <vector>
-#include <functional>
 #include <chrono>
 
 namespace bus {
@@ -39,7 +42,7 @@ namespace bus {
             }
         }
 
-        bool wait_until(std::chrono::system_clock::time_point pt) {
+        bool wait_until(std::chrono::steady_clock::time_point pt) {
             if (!set()) {
                 std::unique_lock<std::mutex> lock(mutex_);
                 return cv_.wait_until(lock, pt, [&] { return set(); });
@@ -57,9 +60,12 @@ namespace bus {
     template<typename T>
     class FutureState {
     public:
+        using Callback = UniqueFunction<void(T&), kTaskInlineSize>;
+
         template<typename... Args>
         void set_value(bool check_double_set, Args&&... args) {
-            std::vector<std::function<void(T&)>> to_call;
+            Callback first;
+            std::vector<Callback> rest;
             if (!evt_.set()) {
                 std::unique_lock lock(mutex_);
                 if (value_) {
@@ -70,7 +76,8 @@ namespace bus {
                     }
                 }
                 value_.emplace(std::forward<Args>(args)...);
-                to_call = std::move(callbacks_);
+                first = std::move(first_callback_);
+                rest = std::move(callbacks_);
             } else {
                 if (check_double_set) {
                     throw std::logic_error("double FutureState::set_value");
@@ -79,7 +86,10 @@ namespace bus {
                 }
             }
             evt_.notify();
-            for (auto& cb : to_call) {
+            if (first) {
+                first(get());
+            }
+            for (auto& cb : rest) {
                 cb(get());
             }
         }
@@ -93,6 +103,8 @@ namespace bus {
                 if (value_) {
                     lock.unlock();
                     f(*value_);
+                } else if (!first_callback_) {
+                    first_callback_ = std::move(f);
                 } else {
                     callbacks_.push_back(std::move(f));
                 }
@@ -119,7 +131,9 @@ namespace bus {
         Event evt_;
         std::mutex mutex_;
         std::optional<T> value_;
-        std::vector<std::function<void(T&)>> callbacks_;
+        // futures mostly get a single continuation, it is kept without a vector allocation
+        Callback first_callback_;
+        std::vector<Callback> callbacks_;
     };
 
     } // namespace internal
@@ -253,7 +267,8 @@ Future<T> make_future(T&& t) {
 template<typename T>
 class Promise {
 public:
-    Promise() : state_(new internal::FutureState<T>()) {}
+    // states are pooled, every rpc makes a few of them
+    Promise() : state_(internal::make_pooled<internal::FutureState<T>>()) {}
 
     Promise(const Promise<T>&) = default;
     Promise(Promise<T>&&) = default;
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+
+namespace bus::internal {
+
+// log-linear histogram: every power of two is split into kSubBuckets linear buckets,
+// so relative error of a reported value is below 1 / kSubBuckets
+class Histogram {
+public:
+    static constexpr size_t kSubBucketBits = 4;
+    static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+    static constexpr size_t kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+public:
+    Histogram() = default;
+    Histogram(const Histogram&) = delete;
+
+    void record(uint64_t value) {
+        buckets_[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    // returns upper bound of the bucket containing requested percentile, p in [0, 1]
+    uint64_t percentile(double p) const {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p * total);
+        if (rank >= total) {
+            rank = total - 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen > rank) {
+                return upper_bound(i);
+            }
+        }
+        return upper_bound(kBuckets - 1);
+    }
+
+    static size_t bucket(uint64_t value) {
+        if (value < kSubBuckets) {
+            return value;
+        }
+        size_t shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+        return (shift + 1) * kSubBuckets + ((value >> shift) - kSubBuckets);
+    }
+
+    static uint64_t lower_bound(size_t bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
+        }
+        size_t shift = bucket / kSubBuckets - 1;
+        return (bucket % kSubBuckets + kSubBuckets) << shift;
+    }
+
+    static uint64_t upper_bound(size_t bucket) {
+        if (bucket + 1 >= kBuckets) {
+            return UINT64_MAX;
+        }
+        return lower_bound(bucket + 1) - 1;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_ = {};
+    std::atomic<uint64_t> count_ = 0;
+};
+
+}
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <atomic>
+#include <functional>
 #include <mutex>
 #include <memory>
 #include <optional>
+#include <thread>
 
 namespace bus::internal {
 
@@ -98,6 +100,115 @@ private:
     std::unique_lock<Lock> lock_;
 };
 
+// read mostly value kept in two instances (left-right): readers never wait and never touch
+// the instance being modified. Writers are serialized, they modify the idle instance, switch readers to it,
+// wait until readers leave the other one and modify it the same way. So modify runs twice, on equal
+// instances, and has to do the same thing both times; updates cost as much as the modification itself.
+// Readers announce themselves in per thread shards of counters, guards are short lived, they block writers
+template<typename T>
+class LeftRightWrapper {
+public:
+    class ReadGuard {
+    public:
+        ReadGuard(const T& value, std::atomic<int64_t>& readers)
+            : value_(value)
+            , readers_(readers)
+        {
+        }
+
+        ReadGuard(const ReadGuard&) = delete;
+
+        ~ReadGuard() {
+            readers_.fetch_sub(1, std::memory_order_release);
+        }
+
+        const T& operator * () const {
+            return value_;
+        }
+
+        const T* operator -> () const {
+            return &value_;
+        }
+
+    private:
+        const T& value_;
+        std::atomic<int64_t>& readers_;
+    };
+
+public:
+    template<typename... Args>
+    LeftRightWrapper(Args&&... args)
+        : left_(std::forward<Args>(args)...)
+        , right_(left_)
+    {
+    }
+
+    LeftRightWrapper(const LeftRightWrapper&) = delete;
+
+    ReadGuard read() const {
+        auto& readers = readers_[version_.load()][shard()].value;
+        // seq_cst orders arrival before the instance is chosen, writer sees either of them
+        readers.fetch_add(1);
+        return ReadGuard(instance(active_.load()), readers);
+    }
+
+    template<typename F>
+    void update(F&& modify) {
+        std::unique_lock lock(mutex_);
+        int active = active_.load(std::memory_order_relaxed);
+        // nobody reads the idle instance, previous update waited readers out of it
+        try {
+            modify(instance(1 - active));
+        } catch (...) {
+            instance(1 - active) = instance(active);
+            throw;
+        }
+        active_.store(1 - active);
+        int version = version_.load(std::memory_order_relaxed);
+        wait_readers(1 - version);
+        version_.store(1 - version);
+        wait_readers(version);
+        modify(instance(active));
+    }
+
+private:
+    static constexpr size_t kShards = 8;
+
+    struct alignas(64) Counter {
+        std::atomic<int64_t> value = 0;
+    };
+
+private:
+    static size_t shard() {
+        static thread_local size_t index = std::hash<std::thread::id>()(std::this_thread::get_id()) % kShards;
+        return index;
+    }
+
+    T& instance(int index) {
+        return index ? right_ : left_;
+    }
+
+    const T& instance(int index) const {
+        return index ? right_ : left_;
+    }
+
+    void wait_readers(int version) {
+        for (auto& counter : readers_[version]) {
+            while (counter.value.load() != 0) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    T left_;
+    T right_;
+    std::atomic<int> active_ = 0;
+    std::atomic<int> version_ = 0;
+    mutable Counter readers_[2][kShards];
+    std::mutex mutex_;
+};
+
 template<typename T, typename Lock=std::mutex>
 class ExclusiveWrapper {
 public:
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+#include <string_view>
+
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+// decoder of detail::MessageBatch from service.proto, walks items in place without libprotobuf
+namespace bus::internal {
+
+// fields of detail::Message, data points into the batch
+struct MessageView {
+    uint64_t seq_id = 0;
+    // detail::Message::Type value
+    int32_t type = 0;
+    uint32_t method = 0;
+    std::string_view data;
+};
+
+namespace batch_wire {
+
+enum WireType : uint8_t {
+    kVarint = 0,
+    kFixed64 = 1,
+    kLength = 2,
+    kFixed32 = 5,
+};
+
+enum Field : uint8_t {
+    kUnknown,
+    kItem,
+    kSeqId,
+    kType,
+    kMethod,
+    kData,
+};
+
+constexpr uint8_t tag(uint32_t field, WireType wire_type) {
+    return field << 3 | wire_type;
+}
+
+// single byte tags of known fields with expected wire types, the rest goes thru generic skip
+struct TagTable {
+    Field batch[128] = {};
+    Field message[128] = {};
+
+    constexpr TagTable() {
+        batch[tag(1, kLength)] = kItem;
+        message[tag(1, kVarint)] = kSeqId;
+        message[tag(2, kVarint)] = kType;
+        message[tag(3, kVarint)] = kMethod;
+        message[tag(4, kLength)] = kData;
+    }
+};
+
+inline constexpr TagTable kTags;
+
+inline bool read_varint_slow(const char*& p, const char* end, uint64_t& value) {
+    value = 0;
+    for (size_t shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = *p++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// swar: terminating byte of a varint up to 8 bytes is found in one word and its 7 bit groups are packed
+// with pext or three shift rounds. Longer ones and buffer tails go byte by byte
+inline bool read_varint(const char*& p, const char* end, uint64_t& value) {
+    if (end - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        if (uint64_t stops = ~word & 0x8080808080808080ull) {
+            size_t len = (__builtin_ctzll(stops) + 1) / 8;
+            if (len < 8) {
+                word &= (1ull << (8 * len)) - 1;
+            }
+#if defined(__BMI2__)
+            value = _pext_u64(word, 0x7f7f7f7f7f7f7f7full);
+#else
+            word = ((word & 0x7f007f007f007f00ull) >> 1) | (word & 0x007f007f007f007full);
+            word = ((word & 0x3fff00003fff0000ull) >> 2) | (word & 0x00003fff00003fffull);
+            word = ((word & 0x0fffffff00000000ull) >> 4) | (word & 0x000000000fffffffull);
+            value = word;
+#endif
+            p += len;
+            return true;
+        }
+    }
+    return read_varint_slow(p, end, value);
+}
+
+inline bool read_length(const char*& p, const char* end, std::string_view& result) {
+    uint64_t len;
+    if (!read_varint(p, end, len) || len > static_cast<uint64_t>(end - p)) {
+        return false;
+    }
+    result = { p, len };
+    p += len;
+    return true;
+}
+
+// groups are deprecated and never written for service.proto, so they are rejected
+inline bool skip_field(uint64_t tag, const char*& p, const char* end) {
+    if (tag >> 3 == 0) {
+        return false;
+    }
+    uint64_t value;
+    std::string_view view;
+    switch (tag & 7) {
+        case kVarint:
+            return read_varint(p, end, value);
+        case kFixed64:
+            if (end - p < 8) {
+                return false;
+            }
+            p += 8;
+            return true;
+        case kLength:
+            return read_length(p, end, view);
+        case kFixed32:
+            if (end - p < 4) {
+                return false;
+            }
+            p += 4;
+            return true;
+        default:
+            return false;
+    }
+}
+
+inline bool read_tag(const char*& p, const char* end, uint64_t& tag, Field& field, const Field (&table)[128]) {
+    uint8_t first = *p;
+    if (first < 128) {
+        ++p;
+        tag = first;
+        field = table[first];
+        return true;
+    }
+    field = kUnknown;
+    return read_varint(p, end, tag) && tag <= UINT32_MAX;
+}
+
+inline bool decode_message(std::string_view serialized, MessageView& message) {
+    const char* p = serialized.data();
+    const char* end = p + serialized.size();
+    message = MessageView();
+    while (p < end) {
+        uint64_t tag;
+        Field field;
+        if (!read_tag(p, end, tag, field, kTags.message)) {
+            return false;
+        }
+        uint64_t value;
+        switch (field) {
+            case kSeqId:
+                if (!read_varint(p, end, message.seq_id)) {
+                    return false;
+                }
+                break;
+            case kType:
+                if (!read_varint(p, end, value)) {
+                    return false;
+                }
+                message.type = static_cast<int32_t>(value);
+                break;
+            case kMethod:
+                if (!read_varint(p, end, value)) {
+                    return false;
+                }
+                message.method = static_cast<uint32_t>(value);
+                break;
+            case kData:
+                if (!read_length(p, end, message.data)) {
+                    return false;
+                }
+                break;
+            default:
+                if (!skip_field(tag, p, end)) {
+                    return false;
+                }
+        }
+    }
+    return true;
+}
+
+}
+
+// calls fn(MessageView&) for every item in order; false on malformed batch,
+// in which case items before the malformed one have been passed already
+template <class F>
+bool for_each_message(std::string_view batch, F&& fn) {
+    using namespace batch_wire;
+    const char* p = batch.data();
+    const char* end = p + batch.size();
+    MessageView message;
+    while (p < end) {
+        uint64_t tag;
+        Field field;
+        if (!read_tag(p, end, tag, field, kTags.batch)) {
+            return false;
+        }
+        if (field != kItem) {
+            if (!skip_field(tag, p, end)) {
+                return false;
+            }
+            continue;
+        }
+        std::string_view item;
+        if (!read_length(p, end, item) || !decode_message(item, message)) {
+            return false;
+        }
+        fn(message);
+    }
+    return true;
+}
+
+// checks the whole batch before any item is used
+inline bool valid_batch(std::string_view batch) {
+    return for_each_message(batch, [] (MessageView&) {});
+}
+
+}
@@ -0,0 +1,128 @@
+#include "metrics.h"
+
+#include <sstream>
+
+namespace bus {
+
+namespace {
+
+std::string metric_key(const std::string& name, std::optional<int> endpoint) {
+    if (!endpoint) {
+        return name;
+    }
+    return name + "{endpoint=" + std::to_string(*endpoint) + "}";
+}
+
+template<typename T>
+T& find_or_create(std::map<std::string, std::unique_ptr<T>>& metrics, std::string key) {
+    auto& result = metrics[std::move(key)];
+    if (!result) {
+        result = std::make_unique<T>();
+    }
+    return *result;
+}
+
+std::string json_string(const std::string& str) {
+    std::string result = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    result += '"';
+    return result;
+}
+
+}
+
+internal::Counter& Metrics::counter(const std::string& name, std::optional<int> endpoint) {
+    return find_or_create(state_.get()->counters_, metric_key(name, endpoint));
+}
+
+internal::Gauge& Metrics::gauge(const std::string& name, std::optional<int> endpoint) {
+    return find_or_create(state_.get()->gauges_, metric_key(name, endpoint));
+}
+
+internal::Histogram& Metrics::histogram(const std::string& name, std::optional<int> endpoint) {
+    return find_or_create(state_.get()->histograms_, metric_key(name, endpoint));
+}
+
+Metrics::HistogramSnapshot Metrics::snapshot(const internal::Histogram& histogram) {
+    return HistogramSnapshot {
+        .count = histogram.count(),
+        .p50 = histogram.percentile(0.5),
+        .p90 = histogram.percentile(0.9),
+        .p99 = histogram.percentile(0.99),
+        .p999 = histogram.percentile(0.999),
+        .max = histogram.percentile(1),
+    };
+}
+
+Metrics::Snapshot Metrics::snapshot() {
+    Snapshot result;
+    auto state = state_.get();
+    for (auto& [name, counter] : state->counters_) {
+        result.counters[name] = counter->value();
+    }
+    for (auto& [name, gauge] : state->gauges_) {
+        result.gauges[name] = gauge->value();
+    }
+    for (auto& [name, histogram] : state->histograms_) {
+        result.histograms[name] = snapshot(*histogram);
+    }
+    return result;
+}
+
+std::string Metrics::Snapshot::to_text() const {
+    std::stringstream out;
+    for (auto& [name, value] : counters) {
+        out << name << " " << value << "\n";
+    }
+    for (auto& [name, value] : gauges) {
+        out << name << " " << value << "\n";
+    }
+    for (auto& [name, value] : histograms) {
+        out << name
+            << " count=" << value.count
+            << " p50=" << value.p50
+            << " p90=" << value.p90
+            << " p99=" << value.p99
+            << " p999=" << value.p999
+            << " max=" << value.max << "\n";
+    }
+    return out.str();
+}
+
+std::string Metrics::Snapshot::to_json() const {
+    std::stringstream out;
+    auto dump = [&] (auto& metrics, auto write_value) {
+        out << "{";
+        bool first = true;
+        for (auto& [name, value] : metrics) {
+            out << (first ? "" : ",") << json_string(name) << ":";
+            write_value(value);
+            first = false;
+        }
+        out << "}";
+    };
+    auto plain = [&] (auto value) { out << value; };
+
+    out << "{\"counters\":";
+    dump(counters, plain);
+    out << ",\"gauges\":";
+    dump(gauges, plain);
+    out << ",\"histograms\":";
+    dump(histograms, [&] (const HistogramSnapshot& value) {
+            out << "{\"count\":" << value.count
+                << ",\"p50\":" << value.p50
+                << ",\"p90\":" << value.p90
+                << ",\"p99\":" << value.p99
+                << ",\"p999\":" << value.p999
+                << ",\"max\":" << value.max << "}";
+        });
+    out << "}";
+    return out.str();
+}
+
+}
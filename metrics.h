@@ -0,0 +1,120 @@
+#pragma once
+
+#include "histogram.h"
+#include "lock.h"
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace bus {
+
+namespace internal {
+
+// striped by thread, so concurrent writers don't share a cache line; shards are summed on read
+class Counter {
+public:
+    static constexpr size_t kShards = 16;
+
+public:
+    Counter() = default;
+    Counter(const Counter&) = delete;
+
+    void add(uint64_t delta = 1) {
+        shards_[shard()].value.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t result = 0;
+        for (auto& shard : shards_) {
+            result += shard.value.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+private:
+    static size_t shard() {
+        static std::atomic<size_t> next_shard = 0;
+        thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % kShards;
+        return shard;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value = 0;
+    };
+
+    std::array<Shard, kShards> shards_;
+};
+
+class Gauge {
+public:
+    Gauge() = default;
+    Gauge(const Gauge&) = delete;
+
+    void set(int64_t value) {
+        value_.store(value, std::memory_order_relaxed);
+    }
+
+    void add(int64_t delta) {
+        value_.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    int64_t value() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> value_ = 0;
+};
+
+}
+
+// named metrics; returned references stay valid for registry lifetime,
+// so hot paths look a metric up once and keep the reference
+class Metrics {
+public:
+    struct HistogramSnapshot {
+        uint64_t count = 0;
+        uint64_t p50 = 0;
+        uint64_t p90 = 0;
+        uint64_t p99 = 0;
+        uint64_t p999 = 0;
+        uint64_t max = 0;
+    };
+
+    struct Snapshot {
+        std::map<std::string, uint64_t> counters;
+        std::map<std::string, int64_t> gauges;
+        std::map<std::string, HistogramSnapshot> histograms;
+
+        std::string to_text() const;
+        std::string to_json() const;
+    };
+
+public:
+    Metrics() = default;
+    Metrics(const Metrics&) = delete;
+
+    internal::Counter& counter(const std::string& name, std::optional<int> endpoint = std::nullopt);
+    internal::Gauge& gauge(const std::string& name, std::optional<int> endpoint = std::nullopt);
+    internal::Histogram& histogram(const std::string& name, std::optional<int> endpoint = std::nullopt);
+
+    Snapshot snapshot();
+
+    static HistogramSnapshot snapshot(const internal::Histogram&);
+
+private:
+    struct State {
+        std::map<std::string, std::unique_ptr<internal::Counter>> counters_;
+        std::map<std::string, std::unique_ptr<internal::Gauge>> gauges_;
+        std::map<std::string, std::unique_ptr<internal::Histogram>> histograms_;
+    };
+
+    internal::ExclusiveWrapper<State> state_;
+};
+
+}
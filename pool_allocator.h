@@ -0,0 +1,102 @@
+#pragma once
+
+#include "lock.h"
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace bus::internal {
+
+// process wide free list of blocks of one size. Up to kMaxSpare released blocks are kept,
+// so objects which are created and destroyed at a steady rate don't reach malloc
+template<size_t kSize>
+class BlockPool {
+public:
+    static void* take() {
+        {
+            auto spare = spare_list().get();
+            if (!spare->empty()) {
+                void* result = spare->back();
+                spare->pop_back();
+                return result;
+            }
+        }
+        return ::operator new(kSize);
+    }
+
+    static void put(void* block) {
+        {
+            auto spare = spare_list().get();
+            if (spare->size() < kMaxSpare) {
+                spare->push_back(block);
+                return;
+            }
+        }
+        ::operator delete(block);
+    }
+
+private:
+    static constexpr size_t kMaxSpare = 4096;
+
+    using SpareList = ExclusiveWrapper<std::vector<void*>, SpinLock>;
+
+    static SpareList& spare_list() {
+        // never destroyed: blocks are released by static objects of other translation units too
+        static SpareList* spare = [] {
+            auto result = new SpareList();
+            result->get()->reserve(kMaxSpare);
+            return result;
+        }();
+        return *spare;
+    }
+};
+
+// allocator of single objects from BlockPool, e.g. for allocate_shared
+template<typename T>
+class PoolAllocator {
+public:
+    using value_type = T;
+
+    PoolAllocator() = default;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>&) {
+    }
+
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= alignof(std::max_align_t));
+        if (n != 1) {
+            return std::allocator<T>().allocate(n);
+        }
+        return static_cast<T*>(BlockPool<sizeof(T)>::take());
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        if (n != 1) {
+            std::allocator<T>().deallocate(ptr, n);
+        } else {
+            BlockPool<sizeof(T)>::put(ptr);
+        }
+    }
+
+    template<typename U>
+    bool operator == (const PoolAllocator<U>&) const {
+        return true;
+    }
+
+    template<typename U>
+    bool operator != (const PoolAllocator<U>&) const {
+        return false;
+    }
+};
+
+// make_shared drawing object and its control block from BlockPool
+template<typename T, typename... Args>
+std::shared_ptr<T> make_pooled(Args&&... args) {
+    return std::allocate_shared<T>(PoolAllocator<T>(), std::forward<Args>(args)...);
+}
+
+}
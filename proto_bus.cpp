@@ -1,21 +1,78 @@
 #include "proto_bus.h"
 #include "delayed_executor.h"
+#include "histogram.h"
+#include "message_batch.h"
+#include "pool_allocator.h"
+#include "trace.h"
 
 #include "service.pb.h"
 
+#include <map>
 #include <memory>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 namespace bus {
     class ProtoBus::Impl {
     public:
+        struct PendingBatch {
+            detail::MessageBatch items;
+            Clock::time_point deadline = Clock::time_point::min();
+        };
+
+        // responses go back on connection the requests came from
+        struct PendingAnswers {
+            int endpoint;
+            detail::MessageBatch items;
+        };
+
+        // fields of a message to batch. Its data is swapped into the added item, so items cleared
+        // by take_items reuse their strings instead of allocating new ones
+        struct Item {
+            uint64_t seq_id;
+            detail::Message::Type type;
+            uint64_t method;
+            std::string data;
+
+            void fill(detail::Message* message) {
+                message->set_seq_id(seq_id);
+                message->set_type(type);
+                message->set_method(method);
+                message->mutable_data()->swap(data);
+            }
+        };
+
+        // returns bytes of a received batch to the bus once all its requests are answered
+        struct InflightBatch {
+            InflightBatch(TcpBus& bus, uint64_t conn_id, size_t bytes)
+                : bus(bus)
+                , conn_id(conn_id)
+                , bytes(bytes)
+            {
+            }
+
+            ~InflightBatch() {
+                bus.release(conn_id, bytes);
+            }
+
+            TcpBus& bus;
+            const uint64_t conn_id;
+            const size_t bytes;
+        };
+
         Impl(Options opts, EndpointManager& manager)
             : greeter_(opts.greeter)
+            , upgrade_local_peers_(opts.upgrade_local_peers)
+            , read_backpressure_(opts.tcp_opts.max_inflight_bytes || opts.tcp_opts.max_connection_inflight_bytes)
             , endpoint_manager_(manager)
             , pool_{ 2 * opts.tcp_opts.max_message_size }
             , bus_(opts.tcp_opts, pool_, manager)
-            , thread_(opts.split_executor ? new internal::DelayedExecutor() : nullptr)
+            , thread_(opts.split_executor ? new internal::DelayedExecutor(opts.executor_cpu) : nullptr)
             , exc_(opts.split_executor ? static_cast<Executor&>(*thread_) : bus_)
             , batch_opts_(opts.batch_opts)
+            , hedge_opts_(opts.hedge_opts)
+            , metrics_(bus_.metrics())
             , flusher_([&]{ timed_flush_batch(); }, opts.batch_opts.max_delay, bus_)
             , loop_([&] { bus_.loop(); }, std::chrono::seconds::zero())
         {
@@ -23,13 +80,18 @@ namespace bus {
                     detail::Greeter greeter;
                     greeter.set_port(opts.tcp_opts.port);
                     greeter.set_force_endpoint(greeter_.has_value());
+                    greeter.set_frame_checksums(opts.tcp_opts.frame_checksums);
                     if (greeter_) {
                         greeter.set_endpoint_id(greeter_.value());
                     }
+                    if (opts.tcp_opts.unix_path) {
+                        greeter.set_unix_path(*opts.tcp_opts.unix_path);
+                    }
                     auto result = SharedView(pool_, greeter.ByteSizeLong());
                     greeter.SerializeToArray(result.data(), result.size());
                     return result;
                 });
+            bus_.set_drop_handler([=] (int, SharedView view) { fail_dropped(view); });
         }
 
         void start() {
@@ -40,146 +102,488 @@ namespace bus {
 
         void handle(TcpBus::ConnHandle handle, SharedView view) {
             if (endpoint_manager_.transient(handle.endpoint)) {
+                bus_.release(handle.conn_id, view.size());
                 bus::detail::Greeter greeter;
                 greeter.ParseFromArray(view.data(), view.size());
+                if (greeter.frame_checksums()) {
+                    bus_.enable_checksums(handle.conn_id);
+                }
                 if (greeter.force_endpoint()) {
                     bus_.rebind(handle.conn_id, greeter.endpoint_id());
                 } else {
-                    int endpoint = endpoint_manager_.resolve(handle.socket, greeter.port());
+                    int endpoint = endpoint_manager_.resolve(handle.socket, greeter.port(), greeter.unix_path());
                     if (!endpoint_manager_.transient(endpoint)) {
                         bus_.rebind(handle.conn_id, endpoint);
+                        // every connection of the peer greets, endpoint is updated by the first one
+                        if (upgrade_local_peers_ && !greeter.unix_path().empty()
+                            && endpoint_manager_.unix_path(endpoint) != greeter.unix_path()
+                            && endpoint_manager_.local_peer(handle.socket))
+                        {
+                            endpoint_manager_.upgrade_to_unix(endpoint, greeter.unix_path());
+                        }
                     } else {
                         bus_.close(handle.conn_id);
                     }
                 }
             } else {
-                bus::detail::MessageBatch batch;
-                batch.ParseFromArray(view.data(), view.size());
-                for (auto& header : *batch.mutable_item()) {
-                    if (header.type() == detail::Message::REQUEST) {
-                        if (handlers_.size() <= header.method() || !handlers_[header.method()]) {
+                // handlers hold it till they answer, the bytes are released after the last one
+                std::shared_ptr<InflightBatch> inflight;
+                if (read_backpressure_) {
+                    inflight = internal::make_pooled<InflightBatch>(bus_, handle.conn_id, view.size());
+                }
+                bool parsed = internal::for_each_message(view.view(), [&] (internal::MessageView& header) {
+                    if (header.type == detail::Message::REQUEST) {
+                        if (handlers_.size() <= header.method || !handlers_[header.method]) {
                             throw BusError("invalid handler number");
                         } else {
-                            handlers_[header.method()](handle.endpoint, header.seq_id(), std::move(*header.mutable_data()));
+                            handlers_[header.method](handle, header.seq_id, header.data, inflight);
                         }
                     }
-                    if (header.type() == detail::Message::RESPONSE) {
-                        std::optional<Promise<ErrorT<std::string>>> to_deliver;
+                    if (header.type == detail::Message::RESPONSE) {
+                        std::optional<Promise<ErrorT<RawResponse>>> to_deliver;
                         {
                             auto reqs = sent_requests_.get();
-                            auto it = reqs->find(header.seq_id());
+                            auto it = reqs->find(header.seq_id);
                             if (it != reqs->end()) {
-                                to_deliver = it->second;
+                                to_deliver = it->second.promise;
+                                client_latency(it->second.method, it->second.endpoint).record(
+                                    std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - it->second.sent_at).count());
+                                // hedged request lost the race
+                                if (it->second.sibling) {
+                                    reqs->erase(*it->second.sibling);
+                                }
                                 reqs->erase(it);
+                            } else {
+                                metrics_.dropped_responses.add();
                             }
                         }
                         if (to_deliver) {
+                            RawResponse response{ .batch = view, .data = header.data };
                             if (thread_) {
-                                thread_->schedule([header=std::move(header), to_deliver=std::move(to_deliver)] () mutable {
-                                        to_deliver->set_value(ErrorT<std::string>::value(std::move(*header.mutable_data())));
+                                thread_->schedule([response=std::move(response), to_deliver=std::move(to_deliver)] () mutable {
+                                        to_deliver->set_value(ErrorT<RawResponse>::value(std::move(response)));
                                     },
                                     std::chrono::seconds::zero());
                             } else {
-                                to_deliver->set_value(ErrorT<std::string>::value(std::move(*header.mutable_data())));
+                                to_deliver->set_value(ErrorT<RawResponse>::value(std::move(response)));
                             }
                         }
                     }
+                });
+                if (!parsed) {
+                    metrics_.malformed_batches.add();
                 }
             }
         }
 
-        bool flush_batch(int endpoint, detail::MessageBatch batch) {
-            if (!batch.item_size()) {
-                return true;
+        // serializes items and clears them under the lock, cleared messages stay allocated for next items
+        std::optional<SharedView> take_items(detail::MessageBatch& items) {
+            if (!items.item_size()) {
+                return std::nullopt;
+            }
+            auto buffer = SharedView(pool_, items.ByteSizeLong());
+            items.SerializeToArray(buffer.data(), buffer.size());
+            metrics_.batch_items.record(items.item_size());
+            metrics_.batch_bytes.record(buffer.size());
+            items.Clear();
+            return buffer;
+        }
+
+        bool flush_batch(int endpoint, SharedView buffer, Clock::time_point deadline) {
+            std::optional<Clock::time_point> bus_deadline;
+            if (deadline != Clock::time_point::max()) {
+                bus_deadline = deadline;
+            }
+            return bus_.send(endpoint, std::move(buffer), bus_deadline);
+        }
+
+        // falls back to endpoint queue if connection is gone
+        void flush_answers(uint64_t conn_id, int endpoint, SharedView buffer) {
+            if (!bus_.answer(conn_id, buffer)) {
+                bus_.send(endpoint, std::move(buffer));
             }
-            auto buffer = SharedView(pool_, batch.ByteSizeLong());
-            batch.SerializeToArray(buffer.data(), buffer.size());
-            return bus_.send(endpoint, std::move(buffer));
         }
 
         void timed_flush_batch() {
             exc_.schedule([=] { timed_flush_batch(); }, batch_opts_.max_delay);
-            std::unordered_map<int, detail::MessageBatch> accumulated;
-            accumulated_.get()->swap(accumulated);
-            for (auto& [endpoint, batch] : accumulated) {
-                flush_batch(endpoint, std::move(batch));
+            std::vector<std::tuple<int, SharedView, Clock::time_point>> batches;
+            {
+                auto accumulated = accumulated_.get();
+                for (auto& [endpoint, batch] : *accumulated) {
+                    if (auto buffer = take_items(batch.items)) {
+                        batches.emplace_back(endpoint, std::move(*buffer), batch.deadline);
+                        batch.deadline = Clock::time_point::min();
+                    }
+                }
+            }
+            for (auto& [endpoint, buffer, deadline] : batches) {
+                flush_batch(endpoint, std::move(buffer), deadline);
+            }
+            std::vector<std::tuple<uint64_t, int, SharedView>> answers;
+            {
+                auto pending = answers_.get();
+                for (auto it = pending->begin(); it != pending->end();) {
+                    if (auto buffer = take_items(it->second.items)) {
+                        answers.emplace_back(it->first, it->second.endpoint, std::move(*buffer));
+                        ++it;
+                    } else {
+                        // connection had nothing to answer for a whole period
+                        it = pending->erase(it);
+                    }
+                }
+            }
+            for (auto& [conn_id, endpoint, buffer] : answers) {
+                flush_answers(conn_id, endpoint, std::move(buffer));
+            }
+        }
+
+        void answer_item(TcpBus::ConnHandle handle, Item item) {
+            // local deliveries and datagrams share connection id
+            if (handle.conn_id == TcpBus::ConnHandle::kLocalConnId || handle.conn_id == TcpBus::ConnHandle::kDatagramConnId) {
+                send_item(handle.endpoint, std::move(item));
+                return;
+            }
+            std::optional<SharedView> to_flush;
+            {
+                auto answers = answers_.get();
+                auto& batch = answers->try_emplace(handle.conn_id, PendingAnswers{ .endpoint = handle.endpoint }).first->second;
+                // connection could be rebound since
+                batch.endpoint = handle.endpoint;
+                item.fill(batch.items.add_item());
+                if (batch.items.item_size() >= batch_opts_.max_batch) {
+                    to_flush = take_items(batch.items);
+                }
+            }
+            if (to_flush) {
+                flush_answers(handle.conn_id, handle.endpoint, std::move(*to_flush));
             }
         }
 
-        bool send_item(int endpoint, detail::Message item) {
-            std::optional<detail::MessageBatch> to_flush;
+        // batch is dropped by bus once deadlines of all its items pass, max is for items without one
+        bool send_item(int endpoint, Item item, Clock::time_point deadline = Clock::time_point::max()) {
+            std::optional<SharedView> to_flush;
+            Clock::time_point batch_deadline;
             {
                 auto accumulated = accumulated_.get();
                 auto& batch = (*accumulated)[endpoint];
-                *batch.add_item() = std::move(item);
+                item.fill(batch.items.add_item());
+                batch.deadline = std::max(batch.deadline, deadline);
 
-                if (batch.item_size() >= batch_opts_.max_batch) {
-                    to_flush.emplace();
-                    to_flush.value() = std::move(batch);
-                    batch.clear_item();
+                if (batch.items.item_size() >= batch_opts_.max_batch) {
+                    to_flush = take_items(batch.items);
+                    batch_deadline = std::exchange(batch.deadline, Clock::time_point::min());
                 }
             }
-            if (to_flush.has_value()) {
-                return flush_batch(endpoint, std::move(to_flush.value()));
+            if (to_flush) {
+                return flush_batch(endpoint, std::move(*to_flush), batch_deadline);
             }
             return true;
         }
 
+        // requests of a batch which expired in bus queue fail at once, unless their hedges are still on the way
+        void fail_dropped(SharedView view) {
+            internal::for_each_message(view.view(), [&] (internal::MessageView& header) {
+                if (header.type != detail::Message::REQUEST) {
+                    return;
+                }
+                std::optional<Promise<ErrorT<RawResponse>>> to_fail;
+                {
+                    auto requests = sent_requests_.get();
+                    auto it = requests->find(header.seq_id);
+                    if (it == requests->end()) {
+                        return;
+                    }
+                    auto sibling = it->second.sibling ? requests->find(*it->second.sibling) : requests->end();
+                    if (sibling != requests->end() && !sibling->second.dropped) {
+                        // entry stays, so that timeout of the primary still finds the pair
+                        it->second.dropped = true;
+                        return;
+                    }
+                    to_fail = it->second.promise;
+                    if (sibling != requests->end()) {
+                        requests->erase(sibling);
+                    }
+                    requests->erase(it);
+                }
+                metrics_.expired_requests.add();
+                to_fail->set_value(ErrorT<RawResponse>::error("deadline exceeded in send queue"));
+            });
+        }
+
+        Future<ErrorT<RawResponse>> send_raw(std::string serialized, int endpoint, std::optional<int> hedge_endpoint, uint64_t method, std::chrono::duration<double> timeout) {
+            uint64_t seq_id = seq_id_.fetch_add(1);
+
+            std::optional<std::string> hedge_data;
+            if (hedge_endpoint && hedge_opts_) {
+                add_hedge_budget();
+                hedge_data = serialized;
+            }
+
+            Item item{ .seq_id = seq_id, .type = detail::Message::REQUEST, .method = method, .data = std::move(serialized) };
+
+            // register promise before sending, response may arrive before send_item returns
+            Promise<ErrorT<RawResponse>> promise;
+            auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(timeout);
+            sent_requests_.get()->insert(seq_id, SentRequest{ .promise = promise, .method = method, .endpoint = endpoint, .sent_at = std::chrono::steady_clock::now(), .deadline = deadline });
+            metrics_.requests.add();
+            if (!send_item(endpoint, std::move(item), deadline)) {
+                sent_requests_.get()->erase(seq_id);
+                metrics_.rejected_requests.add();
+                return bus::make_future(ErrorT<RawResponse>::error("endpoint is down or has too many pending messages"));
+            }
+
+            if (hedge_data) {
+                exc_.schedule([=, hedge_data=std::move(hedge_data)] () mutable {
+                        send_hedge(seq_id, *hedge_endpoint, method, std::move(*hedge_data));
+                    },
+                    hedge_delay(method, endpoint));
+            }
+
+            exc_.schedule([=] () mutable {
+                    {
+                        auto requests = sent_requests_.get();
+                        auto it = requests->find(seq_id);
+                        if (it == requests->end()) {
+                            return;
+                        }
+                        if (it->second.sibling) {
+                            requests->erase(*it->second.sibling);
+                        }
+                        requests->erase(it);
+                    }
+                    metrics_.timeouts.add();
+                    promise.set_value(ErrorT<RawResponse>::error("timeout exceeded"));
+                },
+                timeout);
+            return promise.future();
+        }
+
+        void send_hedge(uint64_t primary_id, int endpoint, uint64_t method, std::string serialized) {
+            uint64_t seq_id = seq_id_.fetch_add(1);
+            Clock::time_point deadline;
+            {
+                auto requests = sent_requests_.get();
+                auto it = requests->find(primary_id);
+                if (it == requests->end() || !take_hedge_token()) {
+                    return;
+                }
+                it->second.sibling = seq_id;
+                deadline = it->second.deadline;
+                metrics_.hedges.add();
+                requests->insert(seq_id, SentRequest{ .promise = it->second.promise, .method = method, .endpoint = endpoint, .sent_at = std::chrono::steady_clock::now(), .deadline = deadline, .sibling = primary_id });
+            }
+
+            Item item{ .seq_id = seq_id, .type = detail::Message::REQUEST, .method = method, .data = std::move(serialized) };
+            if (!send_item(endpoint, std::move(item), deadline)) {
+                std::optional<Promise<ErrorT<RawResponse>>> to_fail;
+                {
+                    auto requests = sent_requests_.get();
+                    requests->erase(seq_id);
+                    if (auto it = requests->find(primary_id); it != requests->end()) {
+                        it->second.sibling.reset();
+                        // primary expired in the meantime, the hedge was its last chance
+                        if (it->second.dropped) {
+                            to_fail = it->second.promise;
+                            requests->erase(it);
+                        }
+                    }
+                }
+                if (to_fail) {
+                    metrics_.expired_requests.add();
+                    to_fail->set_value(ErrorT<RawResponse>::error("deadline exceeded in send queue"));
+                }
+            }
+        }
+
+        Clock::duration hedge_delay(uint64_t method, int endpoint) {
+            auto& histogram = client_latency(method, endpoint);
+            if (histogram.count() < hedge_opts_->min_samples) {
+                return hedge_opts_->initial_delay;
+            }
+            return std::chrono::duration_cast<Clock::duration>(
+                std::chrono::nanoseconds(histogram.percentile(hedge_opts_->percentile)));
+        }
+
+        // round-trip of requests sent to endpoint, in nanoseconds
+        internal::Histogram& client_latency(uint64_t method, int endpoint) {
+            auto histograms = client_latencies_.get();
+            auto& result = (*histograms)[{ method, endpoint }];
+            if (!result) {
+                result = &bus_.metrics().histogram("proto.client_latency.method" + std::to_string(method), endpoint);
+            }
+            return *result;
+        }
+
+        // time from request arrival till handler response, in nanoseconds
+        internal::Histogram& handler_latency(uint64_t method) {
+            auto histograms = handler_latencies_.get();
+            auto& result = (*histograms)[method];
+            if (!result) {
+                result = &bus_.metrics().histogram("proto.handler_latency.method" + std::to_string(method));
+            }
+            return *result;
+        }
+
+        void add_hedge_budget() {
+            auto tokens = hedge_tokens_.get();
+            *tokens = std::min(*tokens + hedge_opts_->budget, hedge_opts_->max_burst);
+        }
+
+        bool take_hedge_token() {
+            auto tokens = hedge_tokens_.get();
+            if (*tokens < 1) {
+                return false;
+            }
+            *tokens -= 1;
+            return true;
+        }
+
+    public:
+        struct BusMetrics {
+            BusMetrics(Metrics& metrics)
+                : requests(metrics.counter("proto.requests"))
+                , rejected_requests(metrics.counter("proto.rejected_requests"))
+                , timeouts(metrics.counter("proto.timeouts"))
+                , expired_requests(metrics.counter("proto.expired_requests"))
+                , malformed_batches(metrics.counter("proto.malformed_batches"))
+                , hedges(metrics.counter("proto.hedges"))
+                , dropped_responses(metrics.counter("proto.dropped_responses"))
+                , batch_items(metrics.histogram("proto.batch_items"))
+                , batch_bytes(metrics.histogram("proto.batch_bytes"))
+            {
+            }
+
+            internal::Counter& requests;
+            internal::Counter& rejected_requests;
+            internal::Counter& timeouts;
+            // dropped from bus queue at deadline
+            internal::Counter& expired_requests;
+            // items up to the malformed one are still handled
+            internal::Counter& malformed_batches;
+            internal::Counter& hedges;
+            // came after the request timed out or its hedge sibling won
+            internal::Counter& dropped_responses;
+            internal::Histogram& batch_items;
+            internal::Histogram& batch_bytes;
+        };
+
+        struct SentRequest {
+            Promise<ErrorT<RawResponse>> promise;
+            uint64_t method;
+            int endpoint;
+            std::chrono::steady_clock::time_point sent_at;
+            Clock::time_point deadline;
+            // hedged duplicate (or primary request for a hedge)
+            std::optional<uint64_t> sibling;
+            // expired in send queue while sibling is on the way
+            bool dropped = false;
+        };
+
+        // requests waiting for response by seq id. Nodes of erased ones are kept for reuse,
+        // so steady traffic doesn't allocate them
+        class SentRequests {
+        public:
+            using Map = std::unordered_map<uint64_t, SentRequest>;
+
+            Map::iterator find(uint64_t seq_id) {
+                return map_.find(seq_id);
+            }
+
+            Map::iterator end() {
+                return map_.end();
+            }
+
+            size_t count(uint64_t seq_id) const {
+                return map_.count(seq_id);
+            }
+
+            SentRequest& at(uint64_t seq_id) {
+                return map_.at(seq_id);
+            }
+
+            void insert(uint64_t seq_id, SentRequest request) {
+                if (spare_.empty()) {
+                    map_.emplace(seq_id, std::move(request));
+                    return;
+                }
+                auto node = std::move(spare_.back());
+                spare_.pop_back();
+                node.key() = seq_id;
+                node.mapped() = std::move(request);
+                map_.insert(std::move(node));
+            }
+
+            void erase(Map::iterator it) {
+                auto node = map_.extract(it);
+                // promise goes now rather than on reuse
+                auto promise = std::move(node.mapped().promise);
+                if (spare_.size() < kMaxSpare) {
+                    spare_.push_back(std::move(node));
+                }
+            }
+
+            void erase(uint64_t seq_id) {
+                if (auto it = map_.find(seq_id); it != map_.end()) {
+                    erase(it);
+                }
+            }
+
+        private:
+            static constexpr size_t kMaxSpare = 1024;
+
+            Map map_;
+            std::vector<Map::node_type> spare_;
+        };
+
     public:
         std::optional<uint64_t> greeter_;
+        const bool upgrade_local_peers_;
+        const bool read_backpressure_;
 
         EndpointManager& endpoint_manager_;
         BufferPool pool_;
         TcpBus bus_;
-        std::vector<std::function<void(int, uint32_t, std::string)>> handlers_;
+        std::vector<std::function<void(TcpBus::ConnHandle, uint64_t, std::string_view, std::shared_ptr<InflightBatch>)>> handlers_;
 
         std::unique_ptr<internal::DelayedExecutor> thread_;
         Executor& exc_;
 
-        internal::ExclusiveWrapper<std::unordered_map<int, detail::MessageBatch>> accumulated_;
+        internal::ExclusiveWrapper<std::unordered_map<int, PendingBatch>> accumulated_;
+        internal::ExclusiveWrapper<std::unordered_map<uint64_t, PendingAnswers>> answers_;
 
-        internal::ExclusiveWrapper<std::unordered_map<uint64_t, Promise<ErrorT<std::string>>>> sent_requests_;
+        internal::ExclusiveWrapper<SentRequests> sent_requests_;
         std::atomic<uint64_t> seq_id_ = 0;
 
         BatchOptions batch_opts_;
+
+        const std::optional<HedgeOptions> hedge_opts_;
+        internal::ExclusiveWrapper<double, internal::SpinLock> hedge_tokens_;
+
+        internal::ExclusiveWrapper<std::map<std::pair<uint64_t, int>, internal::Histogram*>, internal::SpinLock> client_latencies_;
+        internal::ExclusiveWrapper<std::unordered_map<uint64_t, internal::Histogram*>, internal::SpinLock> handler_latencies_;
+
+        BusMetrics metrics_;
+
         internal::PeriodicExecutor flusher_;
         internal::PeriodicExecutor loop_;
     };
 
-    Future<ErrorT<std::string>> ProtoBus::send_raw(std::string serialized, int endpoint, uint64_t method, std::chrono::duration<double> timeout) {
-        detail::Message header;
-        uint64_t seq_id = impl_->seq_id_.fetch_add(1);
-        header.set_seq_id(seq_id);
-        header.set_type(detail::Message::REQUEST);
-        header.set_data(std::move(serialized));
-        header.set_method(method);
-        if (!impl_->send_item(endpoint, std::move(header))) {
-            return bus::make_future(ErrorT<std::string>::error("too many pending messages"));
-        }
-
-        Promise<ErrorT<std::string>> promise;
-        impl_->sent_requests_.get()->insert({ seq_id, promise });
-        impl_->exc_.schedule([=] () mutable {
-                if (auto requests = impl_->sent_requests_.get(); requests->find(seq_id) == requests->end()) {
-                    return;
-                }
-                promise.set_value(ErrorT<std::string>::error("timeout exceeded"));
-            },
-            timeout);
-        return promise.future();
+    Future<ErrorT<ProtoBus::RawResponse>> ProtoBus::send_raw(std::string serialized, int endpoint, std::optional<int> hedge_endpoint, uint64_t method, std::chrono::duration<double> timeout) {
+        return impl_->send_raw(std::move(serialized), endpoint, hedge_endpoint, method, timeout);
     }
 
-    void ProtoBus::register_raw_handler(uint32_t method, std::function<void(int, std::string, std::function<void(std::string)>)> handler) {
+    void ProtoBus::register_raw_handler(uint32_t method, std::function<void(int, std::string_view, Reply)> handler) {
         impl_->handlers_.resize(std::max<uint32_t>(impl_->handlers_.size(), method + 1));
         impl_->handlers_[method] =
-            [handler=std::move(handler), this, method] (int endpoint, uint32_t seq_id, std::string str) {
-                handler(endpoint, std::move(str), [=](std::string str) {
-                    bus::detail::Message header;
-                    header.set_type(detail::Message::RESPONSE);
-                    header.set_data(str);
-                    header.set_seq_id(seq_id);
-                    header.set_method(method);
-                    impl_->send_item(endpoint, std::move(header));
+            [handler=std::move(handler), this, method] (TcpBus::ConnHandle handle, uint64_t seq_id, std::string_view data, std::shared_ptr<Impl::InflightBatch> inflight) {
+                auto received_at = std::chrono::steady_clock::now();
+                trace::record(handle.trace_id, trace::Stage::HandlerStart, handle.endpoint);
+                handler(handle.endpoint, data, [=, inflight=std::move(inflight)](std::string str) {
+                    impl_->handler_latency(method).record(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - received_at).count());
+                    trace::record(handle.trace_id, trace::Stage::HandlerDone, handle.endpoint);
+                    impl_->answer_item(handle, Impl::Item{ .seq_id = seq_id, .type = detail::Message::RESPONSE, .method = method, .data = std::move(str) });
+                    trace::record(handle.trace_id, trace::Stage::ResponseEnqueue, handle.endpoint);
                 });
             };
     }
@@ -197,6 +601,18 @@ namespace bus {
         impl_->bus_.to_break();
     }
 
+    Metrics& ProtoBus::metrics() {
+        return impl_->bus_.metrics();
+    }
+
+    Metrics::HistogramSnapshot ProtoBus::client_latency(uint64_t method, int endpoint) {
+        return Metrics::snapshot(impl_->client_latency(method, endpoint));
+    }
+
+    Metrics::HistogramSnapshot ProtoBus::handler_latency(uint64_t method) {
+        return Metrics::snapshot(impl_->handler_latency(method));
+    }
+
     Executor& ProtoBus::executor() {
         return impl_->bus_;
     }
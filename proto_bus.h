@@ -3,8 +3,10 @@
 #include "bus.h"
 #include "error.h"
 #include "future.h"
+#include "task.h"
 
 #include <functional>
+#include <string_view>
 
 namespace bus {
 
@@ -12,7 +14,18 @@ class ProtoBus {
 public:
     struct BatchOptions {
         size_t max_batch = 1;
-        std::chrono::system_clock::duration max_delay = std::chrono::hours(1);
+        Clock::duration max_delay = std::chrono::hours(1);
+    };
+
+    struct HedgeOptions {
+        // hedge is sent once primary request is slower than this percentile of observed latencies
+        double percentile = 0.95;
+        // hedges allowed per hedgeable request
+        double budget = 0.05;
+        double max_burst = 10;
+        // used until enough latencies are observed
+        size_t min_samples = 100;
+        Clock::duration initial_delay = std::chrono::milliseconds(10);
     };
 
     struct Options {
@@ -20,6 +33,11 @@ public:
         BatchOptions batch_opts;
         std::optional<uint64_t> greeter;
         bool split_executor = false;
+        // cpu for split executor thread
+        std::optional<int> executor_cpu;
+        std::optional<HedgeOptions> hedge_opts;
+        // new connections to peers on the same host go over their unix socket (see TcpBus::Options::unix_path)
+        bool upgrade_local_peers = false;
     };
 
 public:
@@ -30,45 +48,71 @@ public:
 
     template<typename RequestProto, typename ResponseProto>
     Future<ErrorT<ResponseProto>> send(RequestProto proto, int endpoint, uint64_t method, std::chrono::duration<double> timeout) {
-        return send_raw(proto.SerializeAsString(), endpoint, method, timeout).map(
-            [=](ErrorT<std::string>& resp) -> ErrorT<ResponseProto> {
-                if (!resp) {
-                    return ErrorT<ResponseProto>::error(resp.what());
-                } else {
-                    ResponseProto proto;
-                    proto.ParseFromString(resp.unwrap());
-                    return ErrorT<ResponseProto>::value(std::move(proto));
-                }
-            });
+        return send_raw(proto.SerializeAsString(), endpoint, std::nullopt, method, timeout).map(&ProtoBus::parse_response<ResponseProto>);
+    }
+
+    // for idempotent methods only: duplicate is sent to hedge_endpoint if endpoint is slow to answer,
+    // first response wins. Requires Options::hedge_opts
+    template<typename RequestProto, typename ResponseProto>
+    Future<ErrorT<ResponseProto>> send_hedged(RequestProto proto, int endpoint, int hedge_endpoint, uint64_t method, std::chrono::duration<double> timeout) {
+        return send_raw(proto.SerializeAsString(), endpoint, hedge_endpoint, method, timeout).map(&ProtoBus::parse_response<ResponseProto>);
     }
 
     Executor& executor();
+    Metrics& metrics();
+
+    // latency percentiles in nanoseconds, observed by requester and by handler side respectively
+    Metrics::HistogramSnapshot client_latency(uint64_t method, int endpoint);
+    Metrics::HistogramSnapshot handler_latency(uint64_t method);
 
 protected:
+    // sends serialized response. Sized so that a future callback holding it stays inline too
+    using Reply = internal::UniqueFunction<void(std::string), 72>;
+
     template<typename RequestProto, typename ResponseProto>
     void register_handler(uint32_t method, std::function<Future<ResponseProto>(int, RequestProto)> handler) {
-        register_raw_handler(method, [handler=std::move(handler)] (int endp, std::string str, std::function<void(std::string)> cb) {
+        register_raw_handler(method, [handler=std::move(handler)] (int endp, std::string_view data, Reply reply) {
                 RequestProto proto;
-                proto.ParseFromString(str);
-                handler(endp, std::move(proto)).subscribe([cb=std::move(cb)] (ResponseProto& proto) { cb(proto.SerializeAsString()); });
+                proto.ParseFromArray(data.data(), data.size());
+                handler(endp, std::move(proto)).subscribe([reply=std::move(reply)] (ResponseProto& proto) mutable { reply(proto.SerializeAsString()); });
             });
     }
 
     template<typename RequestProto, typename ResponseProto>
     void register_handler(uint32_t method, std::function<void(int, RequestProto, Promise<ResponseProto>)> handler) {
-        register_raw_handler(method, [handler=std::move(handler)] (int endp, std::string str, std::function<void(std::string)> cb) {
+        register_raw_handler(method, [handler=std::move(handler)] (int endp, std::string_view data, Reply reply) {
                 RequestProto proto;
-                proto.ParseFromString(str);
+                proto.ParseFromArray(data.data(), data.size());
                 Promise<ResponseProto> promise;
-                promise.future().subscribe([cb=std::move(cb)] (ResponseProto& proto) { cb(proto.SerializeAsString()); });
+                promise.future().subscribe([reply=std::move(reply)] (ResponseProto& proto) mutable { reply(proto.SerializeAsString()); });
                 handler(endp, std::move(proto), promise);
             });
     }
 
 private:
-    Future<ErrorT<std::string>> send_raw(std::string serialized, int endpoint, uint64_t method, std::chrono::duration<double> timeout);
+    // response bytes within the received batch, which is held till they are parsed
+    struct RawResponse {
+        SharedView batch;
+        std::string_view data;
+    };
+
+    template<typename ResponseProto>
+    static ErrorT<ResponseProto> parse_response(ErrorT<RawResponse>& resp) {
+        if (!resp) {
+            return ErrorT<ResponseProto>::error(resp.what());
+        } else {
+            // batch is released here rather than with the future state, which outlives the response
+            auto batch = std::move(resp.unwrap().batch);
+            ResponseProto proto;
+            proto.ParseFromArray(resp.unwrap().data.data(), resp.unwrap().data.size());
+            return ErrorT<ResponseProto>::value(std::move(proto));
+        }
+    }
+
+    Future<ErrorT<RawResponse>> send_raw(std::string serialized, int endpoint, std::optional<int> hedge_endpoint, uint64_t method, std::chrono::duration<double> timeout);
 
-    void register_raw_handler(uint32_t method, std::function<void(int, std::string, std::function<void(std::string)>)> handler);
+    // request bytes are valid during the handler call only
+    void register_raw_handler(uint32_t method, std::function<void(int, std::string_view, Reply)> handler);
 
 private:
     class Impl;
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace bus::internal {
+
+// growable circular buffer of default constructible values. Unlike std::deque it keeps storage
+// once grown, so queues with steady traffic don't allocate. Popped slots are reset to release what they held
+template<typename T>
+class RingDeque {
+public:
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    T& front() {
+        return slots_[head_];
+    }
+
+    T& operator [] (size_t i) {
+        return slots_[(head_ + i) & (slots_.size() - 1)];
+    }
+
+    void push_back(T value) {
+        reserve_one();
+        slots_[(head_ + size_) & (slots_.size() - 1)] = std::move(value);
+        ++size_;
+    }
+
+    void push_front(T value) {
+        reserve_one();
+        head_ = (head_ - 1) & (slots_.size() - 1);
+        slots_[head_] = std::move(value);
+        ++size_;
+    }
+
+    void pop_front() {
+        slots_[head_] = T();
+        head_ = (head_ + 1) & (slots_.size() - 1);
+        --size_;
+    }
+
+    void clear() {
+        while (!empty()) {
+            pop_front();
+        }
+    }
+
+private:
+    void reserve_one() {
+        if (size_ < slots_.size()) {
+            return;
+        }
+        // capacity stays a power of two
+        std::vector<T> slots(std::max<size_t>(8, 2 * slots_.size()));
+        for (size_t i = 0; i < size_; ++i) {
+            slots[i] = std::move((*this)[i]);
+        }
+        slots_.swap(slots);
+        head_ = 0;
+    }
+
+private:
+    std::vector<T> slots_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+};
+
+}
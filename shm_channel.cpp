@@ -0,0 +1,284 @@
+#include "shm_channel.h"
+
+#include "error.h"
+#include "util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace bus {
+
+struct ShmChannel::RingHeader {
+    // written by producer
+    alignas(64) std::atomic<uint64_t> head;
+    // written by consumer
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> consumer_parked;
+    alignas(64) std::atomic<uint32_t> producer_parked;
+};
+
+namespace {
+
+constexpr size_t kRingHeaderSize = 512;
+// size of the segment is fixed, so the peer can't truncate it under our mapping
+constexpr int kSeals = F_SEAL_SHRINK | F_SEAL_GROW;
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) && std::atomic<uint64_t>::is_always_lock_free);
+
+// closes fds before throwing, errno is preserved
+[[noreturn]] void close_and_throw(const std::array<int, ShmChannel::kFds>& fds) {
+    int error = errno;
+    for (int fd : fds) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    errno = error;
+    throw_errno();
+    __builtin_unreachable();
+}
+
+size_t segment_size(size_t ring_size) {
+    return 2 * (kRingHeaderSize + ring_size);
+}
+
+size_t ring_capacity(size_t requested) {
+    size_t capacity = 4096;
+    while (capacity < requested) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::create(size_t ring_size) {
+    std::array<int, kFds> fds;
+    fds.fill(-1);
+    fds[0] = memfd_create("bus-shm-channel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    CHECK_ERRNO(fds[0] >= 0);
+    for (size_t i = 1; i < kFds; ++i) {
+        fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fds[i] < 0) {
+            close_and_throw(fds);
+        }
+    }
+    size_t capacity = ring_capacity(ring_size);
+    if (ftruncate(fds[0], segment_size(capacity)) != 0 || fcntl(fds[0], F_ADD_SEALS, kSeals) != 0) {
+        close_and_throw(fds);
+    }
+    std::unique_ptr<ShmChannel> channel(new ShmChannel(fds, true, capacity));
+    // fresh memfd is zero filled; both consumers start parked, so the first frame wakes them
+    channel->tx_.header->consumer_parked.store(1);
+    channel->rx_.header->consumer_parked.store(1);
+    return channel;
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::accept(std::array<int, kFds> fds) {
+    struct stat st;
+    int res = fstat(fds[0], &st);
+    size_t ring_size = res == 0 && st.st_size > 2 * kRingHeaderSize ? st.st_size / 2 - kRingHeaderSize : 0;
+    int seals = fcntl(fds[0], F_GET_SEALS);
+    if (ring_size == 0 || (ring_size & (ring_size - 1)) != 0 || seals < 0 || (seals & kSeals) != kSeals) {
+        for (int fd : fds) {
+            ::close(fd);
+        }
+        throw BusError("bad shm channel segment");
+    }
+    return std::unique_ptr<ShmChannel>(new ShmChannel(fds, false, ring_size));
+}
+
+ShmChannel::ShmChannel(std::array<int, kFds> fds, bool creator, size_t ring_size)
+    : fds_(fds)
+    , creator_(creator)
+    , segment_size_(segment_size(ring_size))
+{
+    void* segment = mmap(nullptr, segment_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fds_[0], 0);
+    // destructor doesn't run for channel which failed to construct
+    if (segment == MAP_FAILED) {
+        close_and_throw(fds_);
+    }
+    segment_ = static_cast<char*>(segment);
+
+    Ring rings[2];
+    for (size_t i = 0; i < 2; ++i) {
+        char* base = segment_ + i * (kRingHeaderSize + ring_size);
+        rings[i] = Ring {
+            .header = reinterpret_cast<RingHeader*>(base),
+            .data = base + kRingHeaderSize,
+            .capacity = ring_size,
+        };
+    }
+    // ring 0 goes from creator to acceptor
+    tx_ = rings[creator_ ? 0 : 1];
+    rx_ = rings[creator_ ? 1 : 0];
+}
+
+ShmChannel::~ShmChannel() {
+    if (segment_) {
+        munmap(segment_, segment_size_);
+    }
+    for (int fd : fds_) {
+        ::close(fd);
+    }
+}
+
+void ShmChannel::drain_wake() {
+    uint64_t val;
+    while (::read(wake_fd(), &val, sizeof(val)) == sizeof(val)) {
+    }
+}
+
+void ShmChannel::wake_peer() {
+    uint64_t val = 1;
+    int fd = fds_[creator_ ? 2 : 1];
+    while (::write(fd, &val, sizeof(val)) < 0 && errno == EINTR) {
+    }
+}
+
+bool ShmChannel::write(const char* data, size_t size) {
+    size_t frame_size = internal::header_len + size;
+    if (frame_size > tx_.capacity) {
+        throw BusError("message doesn't fit into shm ring");
+    }
+    auto ring = tx_.header;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (tx_.capacity - (head - ring->tail.load(std::memory_order_acquire)) < frame_size) {
+        ring->producer_parked.store(1, std::memory_order_seq_cst);
+        if (tx_.capacity - (head - ring->tail.load(std::memory_order_seq_cst)) < frame_size) {
+            return false;
+        }
+        ring->producer_parked.store(0, std::memory_order_relaxed);
+    }
+
+    auto copy = [&] (uint64_t pos, const char* src, size_t len) {
+        size_t offset = pos & (tx_.capacity - 1);
+        size_t first = std::min(len, tx_.capacity - offset);
+        memcpy(tx_.data + offset, src, first);
+        memcpy(tx_.data, src + first, len - first);
+    };
+    char header[internal::header_len];
+    internal::write_header(size, header);
+    copy(head, header, internal::header_len);
+    copy(head + internal::header_len, data, size);
+    ring->head.store(head + frame_size, std::memory_order_seq_cst);
+
+    if (ring->consumer_parked.load(std::memory_order_seq_cst) && ring->consumer_parked.exchange(0)) {
+        wake_peer();
+    }
+    return true;
+}
+
+std::optional<size_t> ShmChannel::peek() {
+    auto ring = rx_.header;
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t available = ring->head.load(std::memory_order_acquire) - tail;
+    if (available < internal::header_len) {
+        return std::nullopt;
+    }
+    char header[internal::header_len];
+    size_t offset = tail & (rx_.capacity - 1);
+    size_t first = std::min(internal::header_len, rx_.capacity - offset);
+    memcpy(header, rx_.data + offset, first);
+    memcpy(header + first, rx_.data, internal::header_len - first);
+    size_t size = internal::read_header(header);
+    if (size > rx_.capacity || available < internal::header_len + size) {
+        return std::nullopt;
+    }
+    return size;
+}
+
+void ShmChannel::read(char* dst, size_t size) {
+    auto ring = rx_.header;
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    size_t offset = (tail + internal::header_len) & (rx_.capacity - 1);
+    size_t first = std::min(size, rx_.capacity - offset);
+    memcpy(dst, rx_.data + offset, first);
+    memcpy(dst + first, rx_.data, size - first);
+    ring->tail.store(tail + internal::header_len + size, std::memory_order_seq_cst);
+
+    if (ring->producer_parked.load(std::memory_order_seq_cst) && ring->producer_parked.exchange(0)) {
+        wake_peer();
+    }
+}
+
+bool ShmChannel::park() {
+    auto ring = rx_.header;
+    ring->consumer_parked.store(1, std::memory_order_seq_cst);
+    if (ring->head.load(std::memory_order_seq_cst) != ring->tail.load(std::memory_order_relaxed)) {
+        ring->consumer_parked.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+ssize_t ShmChannel::send_offer(int sock, const iovec* iov, int iovcnt, const std::array<int, kFds>& fds) {
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * kFds)];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<iovec*>(iov);
+    msg.msg_iovlen = iovcnt;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * kFds);
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * kFds);
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+ssize_t ShmChannel::recv_offer(int sock, char* buf, size_t len, std::unique_ptr<ShmChannel>& offered) {
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * kFds)];
+    } control;
+
+    iovec iov = { .iov_base = buf, .iov_len = len };
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t res = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (res <= 0) {
+        return res;
+    }
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        std::array<int, kFds> fds;
+        if (count == kFds) {
+            memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(int) * kFds);
+            offered = accept(fds);
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                ::close(fd);
+            }
+        }
+    }
+    return res;
+}
+
+}
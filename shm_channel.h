@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct iovec;
+
+namespace bus {
+
+// pair of single producer / single consumer byte rings in a memfd segment, one per direction.
+// Each side owns an eventfd which is signalled by the peer only when the side is parked:
+// as consumer on empty rx ring or as producer on full tx ring.
+class ShmChannel {
+public:
+    // memfd, creator wake eventfd, acceptor wake eventfd
+    static constexpr size_t kFds = 3;
+
+public:
+    static std::unique_ptr<ShmChannel> create(size_t ring_size);
+    // takes ownership of fds passed by creating side
+    static std::unique_ptr<ShmChannel> accept(std::array<int, kFds> fds);
+
+    ShmChannel(const ShmChannel&) = delete;
+
+    // fds to pass to the peer
+    const std::array<int, kFds>& fds() const {
+        return fds_;
+    }
+
+    int wake_fd() const {
+        return fds_[creator_ ? 1 : 2];
+    }
+
+    void drain_wake();
+
+    // writes whole frame or nothing, on false the peer wakes us when space is freed
+    bool write(const char* data, size_t size);
+
+    // size of next frame if it is completely written by peer
+    std::optional<size_t> peek();
+    void read(char* dst, size_t size);
+
+    // marks consumer as parked; false if new data raced in and consumer should go on
+    bool park();
+
+    // channel is offered to the peer by passing fds along with the first bytes of a frame over unix socket
+    static ssize_t send_offer(int sock, const iovec* iov, int iovcnt, const std::array<int, kFds>& fds);
+    // read(2) which accepts an offer if one is attached
+    static ssize_t recv_offer(int sock, char* buf, size_t len, std::unique_ptr<ShmChannel>& offered);
+
+    ~ShmChannel();
+
+private:
+    struct RingHeader;
+
+    struct Ring {
+        RingHeader* header = nullptr;
+        char* data = nullptr;
+        uint64_t capacity = 0;
+    };
+
+private:
+    ShmChannel(std::array<int, kFds> fds, bool creator, size_t ring_size);
+
+    void wake_peer();
+
+private:
+    std::array<int, kFds> fds_;
+    const bool creator_;
+
+    char* segment_ = nullptr;
+    size_t segment_size_ = 0;
+
+    Ring tx_;
+    Ring rx_;
+};
+
+}
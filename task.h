@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace bus {
+    namespace internal {
+
+    template<typename Signature, size_t kInlineSize>
+    class UniqueFunction;
+
+    // move-only std::function: callables up to kInlineSize bytes are kept inline, bigger ones go to heap
+    template<typename R, typename... Args, size_t kInlineSize>
+    class UniqueFunction<R(Args...), kInlineSize> {
+    private:
+        struct Ops {
+            R (*invoke)(void* storage, Args&&... args);
+            // move constructs callable at dst and destroys the one at src
+            void (*relocate)(void* dst, void* src) noexcept;
+            void (*destroy)(void* storage) noexcept;
+        };
+
+        template<typename F>
+        static constexpr bool kFitsInline = sizeof(F) <= kInlineSize
+            && alignof(F) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<F>;
+
+        template<typename F>
+        struct InlineOps {
+            static R invoke(void* storage, Args&&... args) {
+                return (*static_cast<F*>(storage))(std::forward<Args>(args)...);
+            }
+
+            static void relocate(void* dst, void* src) noexcept {
+                new (dst) F(std::move(*static_cast<F*>(src)));
+                static_cast<F*>(src)->~F();
+            }
+
+            static void destroy(void* storage) noexcept {
+                static_cast<F*>(storage)->~F();
+            }
+
+            static constexpr Ops kOps = { &invoke, &relocate, &destroy };
+        };
+
+        template<typename F>
+        struct HeapOps {
+            static F*& ptr(void* storage) {
+                return *static_cast<F**>(storage);
+            }
+
+            static R invoke(void* storage, Args&&... args) {
+                return (*ptr(storage))(std::forward<Args>(args)...);
+            }
+
+            static void relocate(void* dst, void* src) noexcept {
+                new (dst) F*(ptr(src));
+            }
+
+            static void destroy(void* storage) noexcept {
+                delete ptr(storage);
+            }
+
+            static constexpr Ops kOps = { &invoke, &relocate, &destroy };
+        };
+
+        template<typename F>
+        static constexpr bool kAccepted = !std::is_same_v<std::decay_t<F>, UniqueFunction>
+            && std::is_invocable_r_v<R, std::decay_t<F>&, Args...>;
+
+    public:
+        UniqueFunction() = default;
+
+        UniqueFunction(std::nullptr_t) {
+        }
+
+        template<typename F, typename = std::enable_if_t<kAccepted<F>>>
+        UniqueFunction(F&& f) {
+            using Callable = std::decay_t<F>;
+            // empty std::function and null function pointers stay empty, as with std::function
+            if constexpr (std::is_constructible_v<bool, const Callable&>) {
+                if (!static_cast<bool>(f)) {
+                    return;
+                }
+            }
+            if constexpr (kFitsInline<Callable>) {
+                new (&storage_) Callable(std::forward<F>(f));
+                ops_ = &InlineOps<Callable>::kOps;
+            } else {
+                new (&storage_) Callable*(new Callable(std::forward<F>(f)));
+                ops_ = &HeapOps<Callable>::kOps;
+            }
+        }
+
+        UniqueFunction(UniqueFunction&& other) noexcept {
+            take(other);
+        }
+
+        UniqueFunction& operator = (UniqueFunction&& other) noexcept {
+            if (this != &other) {
+                reset();
+                take(other);
+            }
+            return *this;
+        }
+
+        UniqueFunction& operator = (std::nullptr_t) noexcept {
+            reset();
+            return *this;
+        }
+
+        UniqueFunction(const UniqueFunction&) = delete;
+        UniqueFunction& operator = (const UniqueFunction&) = delete;
+
+        ~UniqueFunction() {
+            reset();
+        }
+
+        explicit operator bool () const {
+            return ops_ != nullptr;
+        }
+
+        R operator () (Args... args) {
+            return ops_->invoke(&storage_, std::forward<Args>(args)...);
+        }
+
+    private:
+        void take(UniqueFunction& other) noexcept {
+            if (other.ops_) {
+                other.ops_->relocate(&storage_, &other.storage_);
+                ops_ = std::exchange(other.ops_, nullptr);
+            }
+        }
+
+        void reset() noexcept {
+            if (ops_) {
+                std::exchange(ops_, nullptr)->destroy(&storage_);
+            }
+        }
+
+    private:
+        const Ops* ops_ = nullptr;
+        alignas(std::max_align_t) std::byte storage_[kInlineSize];
+    };
+
+    } // namespace internal
+
+// fits promises, shared views and a couple of strings captured by timeouts, continuations and deliveries,
+// whole object is 128 bytes
+constexpr size_t kTaskInlineSize = 112;
+
+using Task = internal::UniqueFunction<void(), kTaskInlineSize>;
+
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "task.h"
+
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <stdint.h>
+
+namespace bus::internal {
+
+// bounded lock-free queue of tasks, any thread pushes and single consumer pops.
+// Cells carry a sequence number: pos + 1 once task at pos is published, pos + capacity once it is taken
+class TaskQueue {
+public:
+    // capacity is a power of two
+    explicit TaskQueue(size_t capacity)
+        : mask_(capacity - 1)
+        , cells_(new Cell[capacity])
+    {
+        assert((capacity & mask_) == 0);
+        for (size_t i = 0; i < capacity; ++i) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    TaskQueue(const TaskQueue&) = delete;
+
+    // task is left untouched when queue is full
+    bool try_push(Task& task) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->task = std::move(task);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only. Task claimed but not yet published by a producer reads as empty,
+    // that producer wakes consumer after publishing
+    bool try_pop(Task& task) {
+        Cell& cell = cells_[head_ & mask_];
+        if (cell.seq.load(std::memory_order_acquire) != head_ + 1) {
+            return false;
+        }
+        task = std::move(cell.task);
+        cell.seq.store(head_ + mask_ + 1, std::memory_order_release);
+        ++head_;
+        return true;
+    }
+
+    // consumer only
+    bool empty() const {
+        return cells_[head_ & mask_].seq.load(std::memory_order_acquire) != head_ + 1;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        Task task;
+    };
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> tail_ = 0;
+    alignas(64) size_t head_ = 0;
+};
+
+}
@@ -4,6 +4,9 @@
 
 #include <thread>
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 using namespace bus;
 
 int main() {
@@ -43,7 +46,20 @@ int main() {
     });
 
     int endpoint = manager.register_endpoint("::1", 4001);
-    for (size_t i = 0; i < messages_count; ++i) {
+    {
+        // one message goes from file with sendfile
+        Operation op;
+        op.set_value(value);
+        op.set_key(key);
+        std::string serialized = "prefix" + op.SerializeAsString();
+
+        int fd = memfd_create("bus-test-file", MFD_CLOEXEC);
+        assert(fd >= 0);
+        assert(write(fd, serialized.data(), serialized.size()) == static_cast<ssize_t>(serialized.size()));
+        auto file = std::make_shared<MappedFile>(fd);
+        second.send(endpoint, SharedView(file, 6, serialized.size() - 6));
+    }
+    for (size_t i = 1; i < messages_count; ++i) {
         Operation op;
         op.set_value(value);
         op.set_key(key);
@@ -1,18 +1,52 @@
 #include "proto_bus.h"
+#include "address_map.h"
+#include "delayed_executor.h"
 #include "bus.h"
+#include "connect_pool.h"
 #include "util.h"
+#include "trace.h"
+#include "checksum.h"
+#include "lock.h"
+#include "message_batch.h"
 
 #include "messages.pb.h"
+#include "service.pb.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <map>
+#include <random>
+#include <regex>
+#include <sched.h>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 
 using namespace bus;
 
 internal::Event event;
 
+// every address lands into one probe run
+struct CollidingHash {
+    size_t operator () (const sockaddr_in6& addr) const {
+        return addr.sin6_port % 2;
+    }
+};
+
 class SimpleService: ProtoBus {
 public:
-    SimpleService(EndpointManager& manager, int port, bool receiver)
-        : ProtoBus({.tcp_opts=TcpBus::Options{.port=port, .fixed_pool_size=2}, .batch_opts={.max_batch=2, .max_delay=std::chrono::seconds(1)}}, manager)
+    using ProtoBus::metrics;
+    using ProtoBus::client_latency;
+    using ProtoBus::handler_latency;
+
+    SimpleService(EndpointManager& manager, TcpBus::Options tcp_opts, bool receiver, bool upgrade_local_peers = false)
+        : ProtoBus({.tcp_opts=tcp_opts, .batch_opts={.max_batch=2, .max_delay=std::chrono::seconds(1)}, .hedge_opts=HedgeOptions{.budget=1, .initial_delay=std::chrono::microseconds(1)},
+            .upgrade_local_peers=upgrade_local_peers}, manager)
     {
         if (receiver) {
             register_handler<Operation, Operation>(1, [&](int, Operation op) -> Future<Operation> {
@@ -57,17 +91,1302 @@ public:
                 });
     }
 
+    void execute_hedged(int endpoint) {
+        Operation op;
+        op.set_key("key");
+        op.set_value("value");
+
+        auto counters = [this] { return metrics().snapshot().counters; };
+        auto hedges = counters()["proto.hedges"];
+        auto dropped = counters()["proto.dropped_responses"];
+        constexpr size_t requests = 10;
+        std::atomic<size_t> completions = 0;
+        for (size_t i = 0; i < requests; ++i) {
+            auto result = send_hedged<Operation, Operation>(op, endpoint, endpoint, 1, std::chrono::seconds(4))
+                .map([&] (ErrorT<Operation>& result) {
+                        ++completions;
+                        return std::move(result);
+                    })
+                .wait();
+            assert(result);
+            assert(result.unwrap().key() == "key - mirrored");
+        }
+        hedges = counters()["proto.hedges"] - hedges;
+        assert(hedges > 0);
+        // response of the losing sibling finds no request and doesn't complete the call again
+        for (size_t i = 0; i < 5000 && counters()["proto.dropped_responses"] - dropped < hedges; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(counters()["proto.dropped_responses"] - dropped == hedges);
+        assert(completions == requests);
+    }
+
 private:
 };
 
 int main() {
     EndpointManager manager;
 
-    SimpleService second(manager, 4002, false);
-    SimpleService first(manager, 4003, true);
+    SimpleService second(manager, {.port=4002, .fixed_pool_size=2, .unix_path="/tmp/bus-test-service-4002.sock"}, false);
+    SimpleService first(manager, {.port=4003, .fixed_pool_size=2}, true);
     int receiver = manager.register_endpoint("::1", 4003);
     second.execute(receiver);
     event.wait();
 
+    second.execute_hedged(receiver);
+
+    // sent before names are resolved, delivered once they are
+    auto bulk = manager.register_endpoints({ { "localhost", 4003 }, { "127.0.0.1", 4003 }, { "localhost", 4003 } });
+    assert(bulk[0] == bulk[2]);
+    assert(manager.resolved(bulk[1]));
+    for (int endpoint : bulk) {
+        second.bench(endpoint, 1);
+    }
+
+    trace::enable(100);
+
     std::cerr << "round-trip thru loopback " << std::chrono::duration_cast<std::chrono::nanoseconds>(second.bench(receiver, 1000)).count() << std::endl;
+
+    auto rtt = second.client_latency(1, receiver);
+    std::cerr << "round-trip percentiles p50=" << rtt.p50 << " p90=" << rtt.p90 << " p99=" << rtt.p99 << " p999=" << rtt.p999 << " max=" << rtt.max << std::endl;
+    assert(rtt.count >= 2000);
+    assert(first.handler_latency(1).count >= 2000);
+
+    trace::disable();
+    auto chrome_trace = trace::export_chrome_trace();
+    assert(chrome_trace.find("\"handler_start\"") != std::string::npos);
+    assert(chrome_trace.find("\"write_done\"") != std::string::npos);
+
+    auto snapshot = second.metrics().snapshot();
+    assert(snapshot.counters["proto.requests"] >= 2000);
+    assert(snapshot.counters["proto.timeouts"] == 0);
+    std::cerr << snapshot.to_text();
+
+    SimpleService unix_receiver(manager, {.port=4004, .fixed_pool_size=2, .unix_path="/tmp/bus-test-service-4004.sock"}, true);
+    int unix_endpoint = manager.register_endpoint("unix:/tmp/bus-test-service-4004.sock", 0);
+    std::cerr << "round-trip thru unix socket " << std::chrono::duration_cast<std::chrono::nanoseconds>(second.bench(unix_endpoint, 1000)).count() << std::endl;
+
+    SimpleService shm_sender(manager, {.port=4005, .fixed_pool_size=2, .unix_path="/tmp/bus-test-service-4005.sock", .shm_ring_size=1 << 16}, false);
+    SimpleService shm_receiver(manager, {.port=4006, .fixed_pool_size=2, .unix_path="/tmp/bus-test-service-4006.sock", .shm_ring_size=1 << 16}, true);
+    int shm_endpoint = manager.register_endpoint("unix:/tmp/bus-test-service-4006.sock", 0);
+    std::cerr << "round-trip thru shm ring " << std::chrono::duration_cast<std::chrono::nanoseconds>(shm_sender.bench(shm_endpoint, 1000)).count() << std::endl;
+    // only greeters go thru the socket
+    assert(shm_sender.metrics().snapshot().counters["tcp.writev_calls"] <= 2);
+
+    SimpleService local_sender(manager, {.port=4007, .fixed_pool_size=2, .local_delivery=true}, false);
+    SimpleService local_receiver(manager, {.port=4008, .fixed_pool_size=2, .local_delivery=true}, true);
+    int local_endpoint = manager.register_endpoint("::1", 4008);
+    std::cerr << "round-trip thru local delivery " << std::chrono::duration_cast<std::chrono::nanoseconds>(local_sender.bench(local_endpoint, 1000)).count() << std::endl;
+    auto local_snapshot = local_sender.metrics().snapshot();
+    assert(local_snapshot.counters["tcp.local_messages"] >= 1000);
+    assert(local_snapshot.counters["tcp.writev_calls"] == 0);
+
+    SimpleService zerocopy_sender(manager, {.port=4009, .fixed_pool_size=2, .zerocopy_threshold=1}, false);
+    SimpleService zerocopy_receiver(manager, {.port=4010, .fixed_pool_size=2, .zerocopy_threshold=1}, true);
+    int zerocopy_endpoint = manager.register_endpoint("::1", 4010);
+    std::cerr << "round-trip with zerocopy sends " << std::chrono::duration_cast<std::chrono::nanoseconds>(zerocopy_sender.bench(zerocopy_endpoint, 1000)).count() << std::endl;
+    auto zerocopy_snapshot = zerocopy_sender.metrics().snapshot();
+    std::cerr << "zerocopy sends " << zerocopy_snapshot.counters["tcp.zerocopy_sends"] << " completions " << zerocopy_snapshot.counters["tcp.zerocopy_completions"] << std::endl;
+    assert(zerocopy_snapshot.counters["tcp.zerocopy_completions"] <= zerocopy_snapshot.counters["tcp.zerocopy_sends"]);
+
+    cpu_set_t cpus;
+    assert(sched_getaffinity(0, sizeof(cpus), &cpus) == 0);
+    int loop_cpu = CPU_SETSIZE - 1;
+    while (!CPU_ISSET(loop_cpu, &cpus)) {
+        --loop_cpu;
+    }
+    SimpleService polling_sender(manager, {.port=4011, .fixed_pool_size=2, .busy_poll=std::chrono::microseconds(50), .loop_cpu=loop_cpu}, false);
+    SimpleService polling_receiver(manager, {.port=4012, .fixed_pool_size=2, .busy_poll=std::chrono::microseconds(50)}, true);
+    int polling_endpoint = manager.register_endpoint("::1", 4012);
+    std::cerr << "round-trip with busy polling " << std::chrono::duration_cast<std::chrono::nanoseconds>(polling_sender.bench(polling_endpoint, 1000)).count() << std::endl;
+    {
+        // loops keep polling for a while after each event, then block in epoll till the next one.
+        // Spinning loop would poll about once per microsecond
+        auto empty_polls = [] (auto& service) { return service.metrics().snapshot().counters["tcp.empty_polls"]; };
+        assert(empty_polls(polling_sender) > 0);
+        assert(empty_polls(polling_receiver) > 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        auto sender_polls = empty_polls(polling_sender);
+        auto receiver_polls = empty_polls(polling_receiver);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        std::cerr << "empty polls while idle " << empty_polls(polling_sender) - sender_polls << " and " << empty_polls(polling_receiver) - receiver_polls << std::endl;
+        assert(empty_polls(polling_sender) - sender_polls < 1000);
+        assert(empty_polls(polling_receiver) - receiver_polls < 1000);
+    }
+
+    {
+        // crc32c check value, instruction and table versions agree on every alignment and length
+        assert(internal::crc32c("123456789", 9) == 0xe3069283);
+        assert(internal::crc32c_portable("123456789", 9) == 0xe3069283);
+        std::string data(1000, 0);
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = i * 31 + 7;
+        }
+        for (size_t offset = 0; offset < 8; ++offset) {
+            for (size_t size = 0; size + offset <= 100; ++size) {
+                assert(internal::crc32c(data.data() + offset, size) == internal::crc32c_portable(data.data() + offset, size));
+            }
+        }
+        assert(internal::crc32c(data.data() + 300, 700, internal::crc32c(data.data(), 300)) == internal::crc32c(data.data(), data.size()));
+
+        char header[internal::header_len];
+        internal::write_header(4000, header, 0xdeadbeef);
+        assert(internal::read_header(header) == 4000);
+        assert(internal::read_checksum(header) == 0xdeadbeef);
+        internal::write_header(4000, header);
+        assert(internal::read_header(header) == 4000);
+        assert(!internal::read_checksum(header));
+    }
+
+    {
+        // tasks take move-only captures, small ones stay inline and big ones still run
+        auto counter = std::make_shared<int>(0);
+        Task small = [counter, owned=std::make_unique<int>(1)] { *counter += *owned; };
+        std::array<char, 2 * kTaskInlineSize> payload{};
+        payload[0] = 2;
+        Task big = [counter, payload] { *counter += payload[0]; };
+        Task moved = std::move(small);
+        assert(!small && moved);
+        moved();
+        big();
+        big = std::move(moved);
+        big();
+        assert(*counter == 4);
+        big = nullptr;
+        assert(counter.use_count() == 1);
+        assert(!Task(std::function<void()>()));
+
+        // continuations run in subscription order
+        Promise<int> promise;
+        std::vector<int> order;
+        for (int i = 0; i < 3; ++i) {
+            promise.future().subscribe([&order, i] (int& v) { order.push_back(v + i); });
+        }
+        promise.set_value(10);
+        assert((order == std::vector<int>{10, 11, 12}));
+    }
+
+    {
+        // immediate tasks from several threads overflow run queue and mix with timers, all of them run
+        std::atomic<size_t> immediate = 0;
+        std::atomic<size_t> timers = 0;
+        constexpr size_t producers = 4;
+        constexpr size_t per_producer = 20000;
+        {
+            internal::DelayedExecutor executor;
+            std::vector<std::thread> threads;
+            auto pt = std::chrono::steady_clock::now();
+            for (size_t t = 0; t < producers; ++t) {
+                threads.emplace_back([&] {
+                    for (size_t i = 0; i < per_producer; ++i) {
+                        executor.schedule([&] { immediate.fetch_add(1); }, std::chrono::seconds::zero());
+                        if (i % 1000 == 0) {
+                            executor.schedule([&] { timers.fetch_add(1); }, std::chrono::microseconds(i));
+                        }
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            while (immediate.load() < producers * per_producer || timers.load() < producers * per_producer / 1000) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            std::cerr << "immediate task dispatch ns " << std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - pt).count() / (producers * per_producer) << std::endl;
+
+            // parked executor wakes up for a single task
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            internal::Event ran;
+            executor.schedule([&] { ran.notify(); }, std::chrono::seconds::zero());
+            ran.wait();
+        }
+    }
+
+    SimpleService checksum_sender(manager, {.port=4027, .fixed_pool_size=2, .frame_checksums=true}, false);
+    SimpleService checksum_receiver(manager, {.port=4028, .fixed_pool_size=2}, true);
+    int checksum_endpoint = manager.register_endpoint("::1", 4028);
+    std::cerr << "round-trip with frame checksums " << std::chrono::duration_cast<std::chrono::nanoseconds>(checksum_sender.bench(checksum_endpoint, 1000)).count() << std::endl;
+    assert(checksum_receiver.metrics().snapshot().counters["tcp.checksum_errors"] == 0);
+    assert(checksum_sender.metrics().snapshot().counters["tcp.checksum_errors"] == 0);
+
+    {
+        // corrupted frame closes connection before delivery, so does frame without checksum after checksummed one
+        // and frame whose size got corrupted past max_message_size
+        enum class Damage { Payload, Unchecked, Size };
+        BufferPool pool{4098};
+        std::atomic<size_t> delivered = 0;
+        TcpBus receiver(TcpBus::Options{.port=4029}, pool, manager);
+        receiver.start([&](auto, auto) { ++delivered; });
+        std::thread receiver_loop([&] { receiver.loop(); });
+
+        for (Damage damage : { Damage::Payload, Damage::Unchecked, Damage::Size }) {
+            int sock = socket(AF_INET6, SOCK_STREAM, 0);
+            assert(sock >= 0);
+            sockaddr_in6 addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin6_family = AF_INET6;
+            addr.sin6_port = htons(4029);
+            addr.sin6_addr = in6addr_loopback;
+            assert(::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+            char frame[internal::header_len + 5];
+            memcpy(frame + internal::header_len, "hello", 5);
+            internal::write_header(5, frame, internal::frame_checksum("hello", 5));
+            assert(write(sock, frame, sizeof(frame)) == sizeof(frame));
+            switch (damage) {
+                case Damage::Payload: frame[internal::header_len] = 'j'; break;
+                case Damage::Unchecked: internal::write_header(5, frame); break;
+                case Damage::Size: frame[2] ^= 0x40; break;
+            }
+            assert(write(sock, frame, sizeof(frame)) == sizeof(frame));
+            char buf;
+            // receiver closes connection
+            assert(read(sock, &buf, 1) <= 0);
+            ::close(sock);
+        }
+        assert(delivered == 3);
+        assert(receiver.metrics().snapshot().counters["tcp.checksum_errors"] == 3);
+        receiver.to_break();
+        receiver_loop.join();
+    }
+
+    {
+        // pool grows while receiver doesn't read and shrinks back once idle
+        BufferPool pool{4098};
+        TcpBus::PoolPolicy policy{.min_connections=1, .max_connections=4, .grow_queue_depth=8, .idle_timeout=std::chrono::milliseconds(100)};
+        TcpBus scaling_sender(TcpBus::Options{.port=4014, .pool_policy=policy}, pool, manager);
+        TcpBus scaling_receiver(TcpBus::Options{.port=4015}, pool, manager);
+        constexpr size_t messages = 4000;
+        std::atomic<size_t> received = 0;
+        internal::Event all_received;
+        scaling_sender.start([](auto, auto) {});
+        scaling_receiver.start([&](auto, SharedView message) {
+                assert(message.size() == 4000);
+                if (++received == messages) {
+                    all_received.notify();
+                }
+            });
+        std::thread sender_loop([&] { scaling_sender.loop(); });
+        int scaling_endpoint = manager.register_endpoint("::1", 4015);
+        for (size_t i = 0; i < messages; ++i) {
+            SharedView message{pool, 4000};
+            memset(message.data(), 'x', message.size());
+            assert(scaling_sender.send(scaling_endpoint, std::move(message)));
+        }
+        std::thread receiver_loop([&] { scaling_receiver.loop(); });
+        all_received.wait();
+        std::this_thread::sleep_for(std::chrono::milliseconds(400));
+        auto counters = scaling_sender.metrics().snapshot().counters;
+        std::cerr << "pool grown " << counters["tcp.pool_grown"] << " shrunk " << counters["tcp.pool_shrunk"] << std::endl;
+        assert(counters["tcp.pool_grown"] == policy.max_connections - policy.min_connections);
+        assert(counters["tcp.pool_shrunk"] == counters["tcp.pool_grown"]);
+        scaling_sender.to_break();
+        scaling_receiver.to_break();
+        sender_loop.join();
+        receiver_loop.join();
+    }
+
+    {
+        // timers within one slack window share a wakeup
+        BufferPool pool{4098};
+        TcpBus coalescing(TcpBus::Options{.port=4013, .timer_slack=std::chrono::milliseconds(50)}, pool, manager);
+        coalescing.start([](auto, auto) {});
+        std::thread loop([&] { coalescing.loop(); });
+        std::atomic<size_t> fired = 0;
+        internal::Event done;
+        for (size_t i = 0; i < 10; ++i) {
+            coalescing.schedule([&] {
+                    if (++fired == 10) {
+                        done.notify();
+                    }
+                }, std::chrono::milliseconds(100) + std::chrono::microseconds(100 * i));
+        }
+        done.wait();
+        coalescing.to_break();
+        loop.join();
+        assert(coalescing.metrics().snapshot().counters["tcp.timer_wakeups"] <= 2);
+    }
+
+    {
+        // nobody listens on 4017: endpoint goes down after refused connects, sends fail without new sockets
+        BufferPool pool{4098};
+        TcpBus client(TcpBus::Options{.port=4016, .fixed_pool_size=2, .reconnect_backoff=std::chrono::milliseconds(50)}, pool, manager);
+        client.start([](auto, auto) {});
+        std::thread loop([&] { client.loop(); });
+        int endpoint = manager.register_endpoint("::1", 4017);
+        auto message = [&] {
+            SharedView buffer{pool, 1};
+            buffer.data()[0] = 0;
+            return buffer;
+        };
+        assert(client.send(endpoint, message()));
+        while (client.send(endpoint, message())) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        size_t connects = client.metrics().snapshot().counters["tcp.connects"];
+        for (size_t i = 0; i < 100; ++i) {
+            assert(!client.send(endpoint, message()));
+        }
+        // a couple of probes go on in background with growing backoff
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        auto counters = client.metrics().snapshot().counters;
+        assert(counters["tcp.down_rejected"] >= 100);
+        assert(counters["tcp.connects"] <= connects + 3);
+        assert(counters["tcp.connect_failures"] >= 2);
+        client.to_break();
+        loop.join();
+    }
+
+    {
+        // two endpoints with two connections each don't fit budget of three, queues survive evictions
+        BufferPool pool{4098};
+        std::atomic<size_t> received = 0;
+        internal::Event all_received;
+        constexpr size_t rounds = 20;
+        auto count = [&](auto, auto) {
+            if (++received == 2 * rounds) {
+                all_received.notify();
+            }
+        };
+        TcpBus first_receiver(TcpBus::Options{.port=4019}, pool, manager);
+        TcpBus second_receiver(TcpBus::Options{.port=4020}, pool, manager);
+        TcpBus client(TcpBus::Options{.port=4018, .fixed_pool_size=2, .connection_budget=3}, pool, manager);
+        first_receiver.start(count);
+        second_receiver.start(count);
+        client.start([](auto, auto) {});
+        std::vector<std::thread> loops;
+        for (TcpBus* bus : { &first_receiver, &second_receiver, &client }) {
+            loops.emplace_back([bus] { bus->loop(); });
+        }
+        int endpoints[] = { manager.register_endpoint("::1", 4019), manager.register_endpoint("::1", 4020) };
+        for (size_t i = 0; i < rounds; ++i) {
+            for (int endpoint : endpoints) {
+                SharedView message{pool, 1};
+                message.data()[0] = 0;
+                assert(client.send(endpoint, std::move(message)));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        all_received.wait();
+        auto counters = client.metrics().snapshot().counters;
+        std::cerr << "evictions " << counters["tcp.evictions"] << std::endl;
+        assert(counters["tcp.evictions"] > 0);
+        for (TcpBus* bus : { &first_receiver, &second_receiver, &client }) {
+            bus->to_break();
+        }
+        for (auto& loop : loops) {
+            loop.join();
+        }
+    }
+
+    {
+        // queue is bounded by bytes, messages still queued at deadline go to drop handler
+        BufferPool pool{4098};
+        internal::Event delivered;
+        TcpBus receiver(TcpBus::Options{.port=4022}, pool, manager);
+        TcpBus client(TcpBus::Options{.port=4021, .fixed_pool_size=1, .max_pending_bytes=100}, pool, manager);
+        receiver.start([&](auto, SharedView message) {
+                assert(message.data()[0] == 'c');
+                delivered.notify();
+            });
+        client.start([](auto, auto) {});
+        std::vector<char> dropped;
+        internal::Event all_dropped;
+        client.set_drop_handler([&](int, SharedView message) {
+                dropped.push_back(message.data()[0]);
+                if (dropped.size() == 2) {
+                    all_dropped.notify();
+                }
+            });
+        int endpoint = manager.register_endpoint("::1", 4022);
+        auto message = [&] (char fill) {
+            SharedView buffer{pool, 40};
+            memset(buffer.data(), fill, buffer.size());
+            return buffer;
+        };
+        // nothing leaves the queue till client loop runs
+        auto deadline = Clock::now() + std::chrono::milliseconds(10);
+        assert(client.send(endpoint, message('a'), deadline));
+        assert(client.send(endpoint, message('b'), deadline));
+        assert(!client.send(endpoint, message('x')));
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::thread receiver_loop([&] { receiver.loop(); });
+        std::thread client_loop([&] { client.loop(); });
+        all_dropped.wait();
+        assert((dropped == std::vector<char>{'a', 'b'}));
+        assert(client.send(endpoint, message('c')));
+        delivered.wait();
+        auto counters = client.metrics().snapshot().counters;
+        assert(counters["tcp.expired_messages"] == 2);
+        assert(counters["tcp.rejected_messages"] == 1);
+        receiver.to_break();
+        client.to_break();
+        receiver_loop.join();
+        client_loop.join();
+    }
+
+    {
+        // reading stops while handler holds delivered bytes and resumes once they are released
+        BufferPool pool{4098};
+        internal::ExclusiveWrapper<std::vector<std::pair<uint64_t, size_t>>> held;
+        std::atomic_bool hold = true;
+        std::atomic<size_t> delivered = 0;
+        internal::Event all_delivered;
+        TcpBus receiver(TcpBus::Options{.port=4024, .max_connection_inflight_bytes=100}, pool, manager);
+        TcpBus client(TcpBus::Options{.port=4023, .fixed_pool_size=1}, pool, manager);
+        receiver.start([&](TcpBus::ConnHandle handle, SharedView message) {
+                if (hold) {
+                    held.get()->emplace_back(handle.conn_id, message.size());
+                } else {
+                    receiver.release(handle.conn_id, message.size());
+                }
+                if (++delivered == 10) {
+                    all_delivered.notify();
+                }
+            });
+        client.start([](auto, auto) {});
+        std::thread receiver_loop([&] { receiver.loop(); });
+        std::thread client_loop([&] { client.loop(); });
+        int endpoint = manager.register_endpoint("::1", 4024);
+        for (size_t i = 0; i < 10; ++i) {
+            SharedView message{pool, 40};
+            memset(message.data(), 'a', message.size());
+            assert(client.send(endpoint, std::move(message)));
+        }
+        while (delivered < 3) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        assert(delivered == 3);
+        assert(receiver.metrics().snapshot().counters["tcp.read_pauses"] >= 1);
+        hold = false;
+        for (auto [conn_id, size] : *held.get()) {
+            receiver.release(conn_id, size);
+        }
+        all_delivered.wait();
+        receiver.to_break();
+        client.to_break();
+        receiver_loop.join();
+        client_loop.join();
+    }
+
+    {
+        // answers are queued on the connection while previous ones are still being written
+        BufferPool pool{4098};
+        std::atomic<size_t> answered = 0;
+        std::atomic<size_t> received = 0;
+        internal::Event all_received;
+        TcpBus receiver(TcpBus::Options{.port=4026}, pool, manager);
+        TcpBus client(TcpBus::Options{.port=4025, .fixed_pool_size=1}, pool, manager);
+        receiver.start([&](TcpBus::ConnHandle handle, SharedView message) {
+                answered += receiver.answer(handle.conn_id, std::move(message));
+            });
+        client.start([&](auto, auto) {
+                if (++received == 200) {
+                    all_received.notify();
+                }
+            });
+        std::thread receiver_loop([&] { receiver.loop(); });
+        std::thread client_loop([&] { client.loop(); });
+        int endpoint = manager.register_endpoint("::1", 4026);
+        for (size_t i = 0; i < 200; ++i) {
+            SharedView message{pool, 4000};
+            memset(message.data(), 'a', message.size());
+            assert(client.send(endpoint, std::move(message)));
+        }
+        all_received.wait();
+        assert(answered == 200);
+        assert(!receiver.answer(TcpBus::ConnHandle::kLocalConnId, SharedView{pool, 1}));
+        receiver.to_break();
+        client.to_break();
+        receiver_loop.join();
+        client_loop.join();
+    }
+
+    {
+        // datagrams are batched into few syscalls and come from the endpoint of sender port
+        BufferPool pool{4098};
+        constexpr size_t messages = 110;
+        std::vector<size_t> sizes;
+        internal::Event all_received;
+        internal::Event unknown_received;
+        int sender_endpoint = manager.register_endpoint("::1", 4030);
+        TcpBus receiver(TcpBus::Options{.port=4031, .datagrams=true}, pool, manager);
+        TcpBus sender(TcpBus::Options{.port=4030, .datagrams=true}, pool, manager);
+        receiver.start([&](TcpBus::ConnHandle handle, SharedView message) {
+                if (manager.transient(handle.endpoint)) {
+                    unknown_received.notify();
+                    return;
+                }
+                assert(handle.endpoint == sender_endpoint);
+                assert(handle.conn_id == TcpBus::ConnHandle::kDatagramConnId);
+                for (size_t i = 0; i < message.size(); ++i) {
+                    assert(message.data()[i] == static_cast<char>(message.size()));
+                }
+                sizes.push_back(message.size());
+                if (sizes.size() == messages) {
+                    all_received.notify();
+                }
+            });
+        sender.start([](auto, auto) {});
+        int endpoint = manager.register_endpoint("::1", 4031);
+        std::vector<size_t> sent;
+        // equal sized ones could go as a single gso send
+        for (size_t i = 0; i < messages; ++i) {
+            size_t size = i < 100 ? 100 : i;
+            SharedView message{pool, size};
+            memset(message.data(), size, size);
+            assert(sender.send_datagram(endpoint, std::move(message)));
+            sent.push_back(size);
+        }
+        std::thread receiver_loop([&] { receiver.loop(); });
+        std::thread sender_loop([&] { sender.loop(); });
+        all_received.wait();
+        std::sort(sizes.begin(), sizes.end());
+        assert(sizes == sent);
+        auto counters = sender.metrics().snapshot().counters;
+        std::cerr << "datagrams " << counters["udp.datagrams_out"] << " in " << counters["udp.syscalls"] << " syscalls" << std::endl;
+        assert(counters["udp.datagrams_out"] == messages);
+        assert(counters["udp.syscalls"] < messages);
+
+        // source of unknown address isn't registered as endpoint
+        int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+        assert(sock >= 0);
+        sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_loopback;
+        assert(bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        sockaddr_in6 source;
+        socklen_t source_len = sizeof(source);
+        assert(getsockname(sock, reinterpret_cast<sockaddr*>(&source), &source_len) == 0);
+        addr.sin6_port = htons(4031);
+        assert(sendto(sock, "x", 1, 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 1);
+        unknown_received.wait();
+        ::close(sock);
+        assert(manager.find(source) == EndpointManager::unbound_v6);
+        receiver.to_break();
+        sender.to_break();
+        receiver_loop.join();
+        sender_loop.join();
+    }
+
+    {
+        // zerocopy buffers still queued in kernel on graceful close aren't reused till they are sent
+        constexpr uint32_t answers = 100;
+        constexpr size_t answer_size = 60000;
+        BufferPool pool{1 << 20};
+        TcpBus server(TcpBus::Options{.port=4034, .max_message_size=1 << 16, .zerocopy_threshold=1}, pool, manager);
+        server.start([&](TcpBus::ConnHandle handle, SharedView) {
+                for (uint32_t i = 0; i < answers; ++i) {
+                    SharedView answer{pool, answer_size};
+                    memset(answer.data(), 1 + i % 251, answer_size);
+                    assert(server.answer(handle.conn_id, std::move(answer)));
+                }
+            });
+        std::thread server_loop([&] { server.loop(); });
+
+        int sock = socket(AF_INET6, SOCK_STREAM, 0);
+        assert(sock >= 0);
+        sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(4034);
+        addr.sin6_addr = in6addr_loopback;
+        assert(::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        char frame[internal::header_len + 1] = {};
+        internal::write_header(1, frame);
+        assert(write(sock, frame, sizeof(frame)) == sizeof(frame));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        assert(shutdown(sock, SHUT_WR) == 0);
+        for (size_t i = 0; i < 5000 && server.metrics().snapshot().counters["tcp.zerocopy_lingering"] == 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(server.metrics().snapshot().counters["tcp.zerocopy_lingering"] == 1);
+        // buffers released by the closed connection would be taken and overwritten now
+        std::vector<SharedView> garbage;
+        for (size_t i = 0; i < 2 * answers; ++i) {
+            garbage.emplace_back(pool, answer_size);
+            memset(garbage.back().data(), 0, answer_size);
+        }
+        std::string received;
+        char buf[1 << 16];
+        ssize_t res;
+        while ((res = read(sock, buf, sizeof(buf))) > 0) {
+            received.append(buf, res);
+        }
+        ::close(sock);
+        size_t frames = 0;
+        for (size_t pos = 0; received.size() - pos >= internal::header_len + answer_size; pos += internal::header_len + answer_size, ++frames) {
+            assert(internal::read_header(received.data() + pos) == answer_size);
+            const char* payload = received.data() + pos + internal::header_len;
+            assert(payload[0] == static_cast<char>(1 + frames % 251));
+            assert(std::all_of(payload, payload + answer_size, [&] (char c) { return c == payload[0]; }));
+        }
+        std::cerr << "zerocopy frames read after close " << frames << std::endl;
+        assert(frames > 0 && frames < answers);
+        server.to_break();
+        server_loop.join();
+    }
+
+    {
+        // answers queued on connection which peer retires are resent to the endpoint of that peer
+        constexpr uint32_t answers = 300;
+        constexpr size_t answer_size = 60000;
+        BufferPool pool{1 << 20};
+        std::vector<std::atomic_bool> seen(answers);
+        std::atomic<uint32_t> seen_count = 0;
+        auto see = [&] (const char* data) {
+            uint32_t id;
+            memcpy(&id, data, sizeof(id));
+            assert(id < answers);
+            if (!seen[id].exchange(true)) {
+                ++seen_count;
+            }
+        };
+        int peer_endpoint = manager.register_endpoint("::1", 4033);
+        TcpBus peer(TcpBus::Options{.port=4033, .max_message_size=1 << 16}, pool, manager);
+        TcpBus server(TcpBus::Options{.port=4032, .fixed_pool_size=1, .max_message_size=1 << 16}, pool, manager);
+        peer.start([&](auto, SharedView message) { see(message.data()); });
+        server.start([&](TcpBus::ConnHandle handle, SharedView) {
+                // as greeter would do for the peer listening on 4033
+                server.rebind(handle.conn_id, peer_endpoint);
+                for (uint32_t i = 0; i < answers; ++i) {
+                    SharedView answer{pool, answer_size};
+                    memset(answer.data(), 0, answer_size);
+                    memcpy(answer.data(), &i, sizeof(i));
+                    assert(server.answer(handle.conn_id, std::move(answer)));
+                }
+            });
+        std::thread peer_loop([&] { peer.loop(); });
+        std::thread server_loop([&] { server.loop(); });
+
+        int sock = socket(AF_INET6, SOCK_STREAM, 0);
+        assert(sock >= 0);
+        int rcvbuf = 4096;
+        assert(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == 0);
+        sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(4032);
+        addr.sin6_addr = in6addr_loopback;
+        assert(::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        char frame[internal::header_len + 1] = {};
+        internal::write_header(1, frame);
+        assert(write(sock, frame, sizeof(frame)) == sizeof(frame));
+        // let the server fill socket buffers and queue the rest, then retire connection without reading
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        assert(shutdown(sock, SHUT_WR) == 0);
+        std::string received;
+        char buf[1 << 16];
+        ssize_t res;
+        while ((res = read(sock, buf, sizeof(buf))) > 0) {
+            received.append(buf, res);
+        }
+        ::close(sock);
+        size_t pos = 0;
+        uint32_t read_by_client = 0;
+        while (received.size() - pos >= internal::header_len + answer_size) {
+            assert(internal::read_header(received.data() + pos) == answer_size);
+            see(received.data() + pos + internal::header_len);
+            pos += internal::header_len + answer_size;
+            ++read_by_client;
+        }
+        assert(read_by_client < answers);
+        for (size_t i = 0; i < 5000 && seen_count < answers; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::cerr << "answers resent after retire " << answers - read_by_client << std::endl;
+        assert(seen_count == answers);
+        peer.to_break();
+        server.to_break();
+        peer_loop.join();
+        server_loop.join();
+    }
+
+    {
+        // batch decoder agrees with libprotobuf on random batches, and accepts corrupted ones only if libprotobuf does
+        std::mt19937_64 rng(42);
+        auto random_bits = [&] {
+            return rng() >> (rng() % 64);
+        };
+        auto add_unknown = [&] (google::protobuf::Message& message) {
+            auto unknown = message.GetReflection()->MutableUnknownFields(&message);
+            int field = 5 + rng() % 3000;
+            switch (rng() % 4) {
+                case 0: unknown->AddVarint(field, random_bits()); break;
+                case 1: unknown->AddFixed32(field, rng()); break;
+                case 2: unknown->AddFixed64(field, rng()); break;
+                case 3: unknown->AddLengthDelimited(field, std::string(rng() % 20, 'u')); break;
+            }
+        };
+        auto decoded_equal = [] (const std::string& serialized, const detail::MessageBatch& batch) {
+            std::vector<internal::MessageView> items;
+            if (!internal::for_each_message(serialized, [&] (internal::MessageView& item) { items.push_back(item); })) {
+                return false;
+            }
+            if (items.size() != static_cast<size_t>(batch.item_size())) {
+                return false;
+            }
+            for (size_t i = 0; i < items.size(); ++i) {
+                auto& expected = batch.item(i);
+                if (items[i].seq_id != expected.seq_id() || items[i].type != expected.type()
+                    || items[i].method != expected.method() || items[i].data != expected.data()) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        size_t accepted_corrupted = 0;
+        for (size_t round = 0; round < 3000; ++round) {
+            detail::MessageBatch batch;
+            size_t items = rng() % 12;
+            for (size_t i = 0; i < items; ++i) {
+                auto item = batch.add_item();
+                item->set_seq_id(random_bits());
+                item->set_type(static_cast<detail::Message::Type>(rng() % 8 == 0 ? static_cast<int32_t>(rng()) : rng() % 2));
+                item->set_method(random_bits());
+                std::string data(rng() % 300, 0);
+                for (auto& c : data) {
+                    c = rng();
+                }
+                item->set_data(std::move(data));
+                if (rng() % 4 == 0) {
+                    add_unknown(*item);
+                }
+            }
+            if (rng() % 8 == 0) {
+                add_unknown(batch);
+            }
+            std::string serialized = batch.SerializeAsString();
+            assert(decoded_equal(serialized, batch));
+
+            if (serialized.empty()) {
+                continue;
+            }
+            std::string corrupted = serialized;
+            if (rng() % 2) {
+                corrupted.resize(rng() % corrupted.size());
+            } else {
+                for (size_t i = 0, flips = 1 + rng() % 3; i < flips; ++i) {
+                    corrupted[rng() % corrupted.size()] = rng();
+                }
+            }
+            detail::MessageBatch reparsed;
+            bool parsed = reparsed.ParseFromString(corrupted);
+            bool decoded = internal::valid_batch(corrupted);
+            if (decoded) {
+                assert(parsed && decoded_equal(corrupted, reparsed));
+                ++accepted_corrupted;
+            }
+        }
+        std::cerr << "corrupted batches accepted by both decoders " << accepted_corrupted << std::endl;
+    }
+
+    // open addressed map agrees with std::map thru collisions, growth and erase from the middle of probe runs
+    {
+        auto address = [] (int port) {
+            sockaddr_in6 addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin6_family = AF_INET6;
+            addr.sin6_port = port;
+            return addr;
+        };
+        internal::AddressMap<CollidingHash> colliding;
+        internal::AddressMap<> hashed;
+        std::map<int, int> expected;
+        std::mt19937 rng(7);
+        for (size_t round = 0; round < 20000; ++round) {
+            int port = rng() % 300;
+            if (rng() % 3 == 0) {
+                bool erased = expected.erase(port);
+                assert(colliding.erase(address(port)) == erased);
+                assert(hashed.erase(address(port)) == erased);
+            } else {
+                int endpoint = rng() % 1000;
+                expected[port] = endpoint;
+                colliding.insert_or_assign(address(port), endpoint);
+                hashed.insert_or_assign(address(port), endpoint);
+            }
+            if (round % 100 == 0) {
+                assert(colliding.size() == expected.size() && hashed.size() == expected.size());
+                for (int port = 0; port < 300; ++port) {
+                    auto it = expected.find(port);
+                    auto want = it == expected.end() ? std::nullopt : std::optional<int>(it->second);
+                    assert(colliding.find(address(port)) == want);
+                    assert(hashed.find(address(port)) == want);
+                }
+            }
+        }
+    }
+
+    // readers see each update whole and never wait for writers; update is visible once it returns
+    {
+        struct Pair {
+            std::vector<int> first;
+            std::vector<int> second;
+        };
+        internal::LeftRightWrapper<Pair> state;
+        std::atomic<int> published = 0;
+        std::atomic_bool stop = false;
+        std::atomic<size_t> reads = 0;
+        std::vector<std::thread> readers;
+        for (size_t i = 0; i < 3; ++i) {
+            readers.emplace_back([&] {
+                    while (!stop.load()) {
+                        int before = published.load();
+                        {
+                            auto pair = state.read();
+                            assert(pair->first.size() == pair->second.size());
+                            assert(pair->first.size() >= before);
+                            for (size_t i = 0; i < pair->first.size(); ++i) {
+                                assert(pair->first[i] == i && pair->second[i] == i);
+                            }
+                        }
+                        ++reads;
+                        std::this_thread::yield();
+                    }
+                });
+        }
+        while (reads.load() == 0) {
+            std::this_thread::yield();
+        }
+        for (int i = 0; i < 2000; ++i) {
+            state.update([&] (Pair& pair) {
+                    pair.first.push_back(i);
+                    pair.second.push_back(i);
+                });
+            published.store(i + 1);
+            std::this_thread::yield();
+        }
+        try {
+            state.update([&] (Pair& pair) {
+                    pair.first.push_back(-1);
+                    throw BusError("rolled back");
+                });
+            assert(false);
+        } catch (const BusError&) {
+        }
+        // failed update left both instances as they were
+        for (int i = 2000; i < 2002; ++i) {
+            state.update([&] (Pair& pair) {
+                    pair.first.push_back(i);
+                    pair.second.push_back(i);
+                });
+            published.store(i + 1);
+        }
+        stop.store(true);
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        assert(state.read()->first.size() == 2002 && state.read()->first == state.read()->second);
+    }
+
+    // regular file at unix path is left alone, stale socket is replaced
+    {
+        std::string path = "/tmp/bus-test-service-4035.sock";
+        unlink(path.c_str());
+        FILE* file = fopen(path.c_str(), "w");
+        assert(file);
+        fclose(file);
+        try {
+            manager.listen_unix(path, 16);
+            assert(false);
+        } catch (const BusError&) {
+        }
+        assert(access(path.c_str(), F_OK) == 0);
+        unlink(path.c_str());
+        manager.listen_unix(path, 16);
+        auto listener = manager.listen_unix(path, 16);
+        unlink(path.c_str());
+    }
+
+    // unix peer which doesn't listen on unix socket is the one at loopback port of its greeter
+    {
+        int fds[2];
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        assert(manager.resolve(fds[0], 4035) == manager.resolve_loopback(4035));
+        assert(manager.resolve(fds[0], 4035, "/tmp/bus-test-service-4035.sock") == manager.register_endpoint("unix:/tmp/bus-test-service-4035.sock", 0));
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    // local delivery keeps pending limits, deadlines and receiver's inflight limit; route follows address change
+    {
+        BufferPool pool{4098};
+        TcpBus sender(TcpBus::Options{.port=4036, .max_pending_messages=4, .local_delivery=true}, pool, manager);
+        TcpBus receiver(TcpBus::Options{.port=4037, .local_delivery=true, .max_inflight_bytes=1}, pool, manager);
+        std::atomic<size_t> delivered = 0;
+        std::atomic<size_t> dropped = 0;
+        sender.set_drop_handler([&](int, SharedView) { ++dropped; });
+        sender.start([](auto, auto) {});
+        receiver.start([&](auto, auto) { ++delivered; });
+        std::thread sender_loop([&] { sender.loop(); });
+        std::thread receiver_loop([&] { receiver.loop(); });
+        auto wait_for = [] (std::atomic<size_t>& value, size_t expected) {
+            for (size_t i = 0; i < 5000 && value.load() < expected; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            assert(value.load() == expected);
+        };
+        auto message = [&] {
+            SharedView message{pool, 10};
+            memset(message.data(), 'x', message.size());
+            return message;
+        };
+        int endpoint = manager.register_endpoint("::1", 4037);
+
+        // the first message takes the whole inflight budget, the rest wait in receiver and fill sender's limit
+        assert(sender.send(endpoint, message()));
+        wait_for(delivered, 1);
+        for (size_t i = 0; i < 4; ++i) {
+            assert(sender.send(endpoint, message()));
+        }
+        assert(!sender.send(endpoint, message()));
+        assert(sender.metrics().snapshot().counters["tcp.rejected_messages"] == 1);
+        for (size_t i = 2; i <= 5; ++i) {
+            receiver.release(TcpBus::ConnHandle::kLocalConnId, 10);
+            wait_for(delivered, i);
+        }
+
+        // expires while waiting, goes to sender's drop handler
+        assert(sender.send(endpoint, message(), Clock::now() + std::chrono::milliseconds(1)));
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        receiver.release(TcpBus::ConnHandle::kLocalConnId, 10);
+        wait_for(dropped, 1);
+        assert(delivered == 5);
+
+        // nobody serves the new address in this process, so message leaves thru socket
+        size_t local_messages = sender.metrics().snapshot().counters["tcp.local_messages"];
+        manager.upgrade_to_unix(endpoint, "/tmp/bus-test-service-4038.sock");
+        sender.send(endpoint, message());
+        assert(sender.metrics().snapshot().counters["tcp.local_messages"] == local_messages);
+
+        sender.to_break();
+        receiver.to_break();
+        sender_loop.join();
+        receiver_loop.join();
+    }
+
+    // loop() after to_break() returns at once, however many times it is called
+    {
+        BufferPool pool{4098};
+        TcpBus stopped(TcpBus::Options{.port=4039}, pool, manager);
+        stopped.start([](auto, auto) {});
+        stopped.to_break();
+        stopped.loop();
+        stopped.loop();
+    }
+
+    // export racing with a thread which wraps its ring never shows torn events
+    {
+        constexpr uint64_t kFirstId = uint64_t(1) << 40;
+        std::atomic_bool stop = false;
+        std::thread writer([&] {
+                for (uint64_t id = kFirstId; !stop.load(std::memory_order_relaxed); ++id) {
+                    trace::record_event(id, trace::Stage::HandlerStart, id % 1000000);
+                }
+            });
+        std::regex event("\"id\":([0-9]+),[^}]*\"endpoint\":(-?[0-9]+)");
+        size_t checked = 0;
+        for (size_t round = 0; round < 20; ++round) {
+            auto exported = trace::export_chrome_trace();
+            for (auto it = std::sregex_iterator(exported.begin(), exported.end(), event); it != std::sregex_iterator(); ++it) {
+                uint64_t id = std::stoull((*it)[1]);
+                if (id >= kFirstId) {
+                    assert(std::stoll((*it)[2]) == id % 1000000);
+                    ++checked;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        stop.store(true);
+        writer.join();
+        assert(checked > 0);
+    }
+
+    // message being written when peer closes connection is resent before the ones queued behind it
+    {
+        constexpr uint32_t messages = 300;
+        constexpr size_t message_size = 60000;
+        BufferPool pool{1 << 20};
+        int listener = socket(AF_INET6, SOCK_STREAM, 0);
+        assert(listener >= 0);
+        int reuse = 1;
+        assert(setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == 0);
+        // accepted sockets inherit it, so the sender is stuck in the middle of a message
+        int rcvbuf = 4096;
+        assert(setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == 0);
+        sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(4040);
+        addr.sin6_addr = in6addr_loopback;
+        assert(bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        assert(listen(listener, 4) == 0);
+
+        TcpBus sender(TcpBus::Options{.port=4041, .fixed_pool_size=1}, pool, manager);
+        sender.start([](auto, auto) {});
+        std::thread sender_loop([&] { sender.loop(); });
+        int endpoint = manager.register_endpoint("::1", 4040);
+        for (uint32_t i = 0; i < messages; ++i) {
+            SharedView message{pool, message_size};
+            memset(message.data(), 0, message_size);
+            memcpy(message.data(), &i, sizeof(i));
+            assert(sender.send(endpoint, std::move(message)));
+        }
+
+        int first = accept(listener, nullptr, nullptr);
+        assert(first >= 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        assert(shutdown(first, SHUT_WR) == 0);
+        // whatever sender has written still comes thru, the partially written message doesn't
+        size_t received = 0;
+        char buf[1 << 16];
+        ssize_t res;
+        while ((res = read(first, buf, sizeof(buf))) > 0) {
+            received += res;
+        }
+        ::close(first);
+        uint32_t written = received / (internal::header_len + message_size);
+        int second = accept(listener, nullptr, nullptr);
+        assert(second >= 0);
+        timeval timeout{.tv_sec = 10, .tv_usec = 0};
+        assert(setsockopt(second, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0);
+        std::vector<uint32_t> ids;
+        std::vector<char> frame(internal::header_len + message_size);
+        while (ids.empty() || ids.back() != messages - 1) {
+            size_t offset = 0;
+            while (offset < frame.size()) {
+                ssize_t res = read(second, frame.data() + offset, frame.size() - offset);
+                assert(res > 0);
+                offset += res;
+            }
+            assert(internal::read_header(frame.data()) == message_size);
+            uint32_t id;
+            memcpy(&id, frame.data() + internal::header_len, sizeof(id));
+            ids.push_back(id);
+        }
+        ::close(second);
+        ::close(listener);
+        std::cerr << "messages sent after close " << ids.size() << std::endl;
+        assert(written > 0 && ids.front() == written);
+        for (size_t i = 1; i < ids.size(); ++i) {
+            assert(ids[i] == ids[i - 1] + 1);
+        }
+        sender.to_break();
+        sender_loop.join();
+    }
+
+    // short burst doesn't grow the pool, it has to stay deep for grow_after
+    {
+        BufferPool pool{4098};
+        TcpBus::PoolPolicy policy{.max_connections=4, .grow_queue_depth=2, .grow_after=std::chrono::milliseconds(500)};
+        TcpBus sender(TcpBus::Options{.port=4042, .pool_policy=policy}, pool, manager);
+        TcpBus receiver(TcpBus::Options{.port=4043}, pool, manager);
+        constexpr size_t messages = 64;
+        std::atomic<size_t> received = 0;
+        internal::Event all_received;
+        sender.start([](auto, auto) {});
+        receiver.start([&](auto, SharedView) {
+                if (++received == messages) {
+                    all_received.notify();
+                }
+            });
+        std::thread sender_loop([&] { sender.loop(); });
+        std::thread receiver_loop([&] { receiver.loop(); });
+        int endpoint = manager.register_endpoint("::1", 4043);
+        for (size_t i = 0; i < messages; ++i) {
+            SharedView message{pool, 100};
+            memset(message.data(), 'x', message.size());
+            assert(sender.send(endpoint, std::move(message)));
+        }
+        all_received.wait();
+        assert(sender.metrics().snapshot().counters["tcp.pool_grown"] == 0);
+        sender.to_break();
+        receiver.to_break();
+        sender_loop.join();
+        receiver_loop.join();
+    }
+
+    // retiring connections don't count towards pool size of their endpoint
+    {
+        ConnectPool pool;
+        uint64_t kept = pool.make_id();
+        uint64_t retired = pool.make_id();
+        pool.add(SocketHolder(socket(AF_INET6, SOCK_STREAM, 0)), kept, 7);
+        pool.add(SocketHolder(socket(AF_INET6, SOCK_STREAM, 0)), retired, 7);
+        assert(pool.count_connections(7) == 2);
+        pool.retire(retired);
+        assert(pool.count_connections(7) == 1);
+        assert(pool.count_connections() == 2);
+        assert(pool.count_retired_connections() == 1);
+        pool.close(retired);
+        assert(pool.count_connections(7) == 1);
+        assert(pool.count_connections(8) == 0);
+    }
+
+    // half a hedge per request: the first hedge waits for two requests, the budget is spent on it
+    {
+        ProtoBus client({.tcp_opts={.port=4044}, .hedge_opts=ProtoBus::HedgeOptions{.budget=0.5, .max_burst=1, .initial_delay=std::chrono::microseconds(1)}}, manager);
+        client.start();
+        Operation op;
+        op.set_key("key");
+        for (size_t i = 0; i < 3; ++i) {
+            auto result = client.send_hedged<Operation, Operation>(op, receiver, receiver, 1, std::chrono::seconds(4)).wait();
+            assert(result);
+        }
+        assert(client.metrics().snapshot().counters["proto.hedges"] == 1);
+    }
+
+    // answers queued on connection which peer resets are resent to the endpoint of that peer,
+    // those already handed to the kernel are lost with the connection
+    {
+        constexpr uint32_t answers = 300;
+        constexpr size_t answer_size = 60000;
+        BufferPool pool{1 << 20};
+        std::vector<std::atomic_bool> seen(answers);
+        int peer_endpoint = manager.register_endpoint("::1", 4049);
+        TcpBus peer(TcpBus::Options{.port=4049, .max_message_size=1 << 16}, pool, manager);
+        TcpBus server(TcpBus::Options{.port=4048, .fixed_pool_size=1, .max_message_size=1 << 16}, pool, manager);
+        std::atomic<uint32_t> seen_count = 0;
+        peer.start([&](auto, SharedView message) {
+                uint32_t id;
+                memcpy(&id, message.data(), sizeof(id));
+                assert(id < answers && !seen[id].exchange(true));
+                ++seen_count;
+            });
+        server.start([&](TcpBus::ConnHandle handle, SharedView) {
+                server.rebind(handle.conn_id, peer_endpoint);
+                for (uint32_t i = 0; i < answers; ++i) {
+                    SharedView answer{pool, answer_size};
+                    memset(answer.data(), 0, answer_size);
+                    memcpy(answer.data(), &i, sizeof(i));
+                    assert(server.answer(handle.conn_id, std::move(answer)));
+                }
+            });
+        std::thread peer_loop([&] { peer.loop(); });
+        std::thread server_loop([&] { server.loop(); });
+
+        int sock = socket(AF_INET6, SOCK_STREAM, 0);
+        assert(sock >= 0);
+        int rcvbuf = 4096;
+        assert(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == 0);
+        sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(4048);
+        addr.sin6_addr = in6addr_loopback;
+        assert(::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+        char frame[internal::header_len + 1] = {};
+        internal::write_header(1, frame);
+        assert(write(sock, frame, sizeof(frame)) == sizeof(frame));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        linger reset{.l_onoff = 1, .l_linger = 0};
+        assert(setsockopt(sock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset)) == 0);
+        ::close(sock);
+        for (size_t i = 0; i < 5000 && !seen[answers - 1]; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::cerr << "answers resent after reset " << seen_count << std::endl;
+        assert(seen_count > 0);
+        uint32_t first = answers - seen_count;
+        for (uint32_t i = first; i < answers; ++i) {
+            assert(seen[i]);
+        }
+        peer.to_break();
+        server.to_break();
+        peer_loop.join();
+        server_loop.join();
+    }
+
+    // primary expires in send queue while its hedge waits for an endpoint which never answers,
+    // the call still times out. Executor thread is held up, so the expiry comes before the timeout task
+    {
+        auto listen_on = [] (int port) {
+            int listener = socket(AF_INET6, SOCK_STREAM, 0);
+            assert(listener >= 0);
+            int reuse = 1;
+            assert(setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == 0);
+            int rcvbuf = 4096;
+            assert(setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == 0);
+            sockaddr_in6 addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin6_family = AF_INET6;
+            addr.sin6_port = htons(port);
+            addr.sin6_addr = in6addr_loopback;
+            assert(bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+            assert(listen(listener, 4) == 0);
+            return listener;
+        };
+        int stalled = listen_on(4045);
+        int silent = listen_on(4046);
+        ProtoBus client({.tcp_opts={.port=4047, .fixed_pool_size=1, .max_message_size=9 << 20}, .split_executor=true,
+            .hedge_opts=ProtoBus::HedgeOptions{.budget=1, .initial_delay=std::chrono::microseconds(1)}}, manager);
+        client.start();
+        int stalled_endpoint = manager.register_endpoint("::1", 4045);
+        int silent_endpoint = manager.register_endpoint("::1", 4046);
+
+        // fills socket buffers of the stalled endpoint, so the next request stays queued
+        Operation filler;
+        filler.set_value(std::string(8 << 20, 'f'));
+        client.send<Operation, Operation>(filler, stalled_endpoint, 1, std::chrono::seconds(10));
+        int stalled_conn = accept(stalled, nullptr, nullptr);
+        assert(stalled_conn >= 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        Operation op;
+        op.set_key("key");
+        std::atomic_bool resolved = false;
+        std::atomic_bool failed = false;
+        client.send_hedged<Operation, Operation>(op, stalled_endpoint, silent_endpoint, 1, std::chrono::milliseconds(200))
+            .subscribe([&] (ErrorT<Operation>& result) {
+                    failed = !result;
+                    resolved = true;
+                });
+        for (size_t i = 0; i < 5000 && client.metrics().snapshot().counters["proto.hedges"] == 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(client.metrics().snapshot().counters["proto.hedges"] == 1);
+        // response callbacks run on executor thread, this one keeps it busy past the timeout.
+        // Receiver answers in batches of two
+        for (size_t i = 0; i < 2; ++i) {
+            client.send<Operation, Operation>(op, receiver, 1, std::chrono::seconds(4))
+                .subscribe([] (ErrorT<Operation>&) { std::this_thread::sleep_for(std::chrono::milliseconds(300)); });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        // stalled endpoint starts reading, the expired primary is dropped from the queue
+        std::thread drain([&] {
+                char buf[1 << 16];
+                while (read(stalled_conn, buf, sizeof(buf)) > 0) {
+                }
+            });
+        for (size_t i = 0; i < 5000 && !resolved; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        assert(resolved && failed);
+        auto counters = client.metrics().snapshot().counters;
+        assert(counters["tcp.expired_messages"] == 1);
+        assert(counters["proto.timeouts"] == 1);
+        shutdown(stalled_conn, SHUT_RDWR);
+        drain.join();
+        ::close(stalled_conn);
+        ::close(stalled);
+        ::close(silent);
+    }
+
+    // local peer greeting over every connection of its pool moves its endpoint to unix socket once
+    {
+        int client_endpoint = manager.register_endpoint("::1", 4051);
+        std::atomic<size_t> notified = 0;
+        auto subscription = manager.subscribe_resolved([&] (int endpoint) {
+                notified += endpoint == client_endpoint;
+            });
+        SimpleService server(manager, {.port=4050}, true, true);
+        SimpleService client(manager, {.port=4051, .fixed_pool_size=4, .unix_path="/tmp/bus-test-service-4051.sock"}, false);
+        client.bench(manager.register_endpoint("::1", 4050), 20);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        manager.unsubscribe_resolved(subscription);
+        assert(manager.unix_path(client_endpoint) == "/tmp/bus-test-service-4051.sock");
+        assert(notified == 1);
+    }
 }
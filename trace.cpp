@@ -0,0 +1,208 @@
+#include "trace.h"
+
+#include "lock.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+namespace bus::trace {
+
+namespace {
+
+struct Event {
+    uint64_t trace_id;
+    uint64_t ts_ns;
+    int endpoint;
+    Stage stage;
+};
+
+// single producer ring. Slots are seqlocked, readers racing with the owner thread
+// skip the entries being overwritten while they copy them
+class Ring {
+public:
+    static constexpr size_t kCapacity = 4096;
+
+public:
+    Ring(uint32_t thread_index)
+        : thread_index_(thread_index)
+    {
+    }
+
+    void push(const Event& event) {
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        Slot& slot = slots_[head % kCapacity];
+        slot.seq.store(2 * head + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.trace_id.store(event.trace_id, std::memory_order_relaxed);
+        slot.ts_ns.store(event.ts_ns, std::memory_order_relaxed);
+        slot.endpoint.store(event.endpoint, std::memory_order_relaxed);
+        slot.stage.store(event.stage, std::memory_order_relaxed);
+        slot.seq.store(2 * head + 2, std::memory_order_release);
+        head_.store(head + 1, std::memory_order_release);
+    }
+
+    void read(std::vector<std::pair<uint32_t, Event>>& out) const {
+        uint64_t head = head_.load(std::memory_order_acquire);
+        uint64_t begin = head > kCapacity ? head - kCapacity : 0;
+        for (uint64_t i = begin; i < head; ++i) {
+            const Slot& slot = slots_[i % kCapacity];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq != 2 * i + 2) {
+                continue;
+            }
+            Event event{
+                .trace_id = slot.trace_id.load(std::memory_order_relaxed),
+                .ts_ns = slot.ts_ns.load(std::memory_order_relaxed),
+                .endpoint = slot.endpoint.load(std::memory_order_relaxed),
+                .stage = slot.stage.load(std::memory_order_relaxed),
+            };
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == seq) {
+                out.push_back({ thread_index_, event });
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        // 2 * (position + 1) once event at position is written, odd while it is being written
+        std::atomic<uint64_t> seq = 0;
+        std::atomic<uint64_t> trace_id;
+        std::atomic<uint64_t> ts_ns;
+        std::atomic<int> endpoint;
+        std::atomic<Stage> stage;
+    };
+
+private:
+    const uint32_t thread_index_;
+    std::array<Slot, kCapacity> slots_;
+    std::atomic<uint64_t> head_ = 0;
+};
+
+std::atomic<size_t> sample_every_ = 0;
+std::atomic<uint64_t> next_trace_id_ = 1;
+
+internal::ExclusiveWrapper<std::vector<std::shared_ptr<Ring>>>& rings() {
+    static internal::ExclusiveWrapper<std::vector<std::shared_ptr<Ring>>> rings;
+    return rings;
+}
+
+Ring& thread_ring() {
+    thread_local std::shared_ptr<Ring> ring = [] {
+        auto registered = rings().get();
+        auto result = std::make_shared<Ring>(registered->size());
+        registered->push_back(result);
+        return result;
+    }();
+    return *ring;
+}
+
+const char* stage_name(Stage stage) {
+    switch (stage) {
+        case Stage::Enqueue: return "enqueue";
+        case Stage::Dequeue: return "dequeue";
+        case Stage::WriteDone: return "write_done";
+        case Stage::ReadDone: return "read_done";
+        case Stage::HandlerStart: return "handler_start";
+        case Stage::HandlerDone: return "handler_done";
+        case Stage::ResponseEnqueue: return "response_enqueue";
+    }
+    return "unknown";
+}
+
+// async span phase: message flow begins at first stage and ends at the last one
+char stage_phase(Stage stage) {
+    switch (stage) {
+        case Stage::Enqueue:
+        case Stage::ReadDone:
+            return 'b';
+        case Stage::WriteDone:
+        case Stage::ResponseEnqueue:
+            return 'e';
+        default:
+            return 'n';
+    }
+}
+
+const char* flow_name(Stage stage) {
+    return stage <= Stage::WriteDone ? "egress" : "ingress";
+}
+
+}
+
+void enable(size_t sample_every) {
+    sample_every_.store(sample_every, std::memory_order_relaxed);
+}
+
+void disable() {
+    enable(0);
+}
+
+uint64_t sample() {
+    size_t every = sample_every_.load(std::memory_order_relaxed);
+    if (every == 0) {
+        return 0;
+    }
+    // random rather than every n-th, so that interleaved kinds of messages
+    // (e.g. requests and responses on one loop thread) are all sampled
+    thread_local uint64_t state = reinterpret_cast<uintptr_t>(&state) | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    if (state % every != 0) {
+        return 0;
+    }
+    return next_trace_id_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void record_event(uint64_t trace_id, Stage stage, int endpoint) {
+    auto ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    thread_ring().push(Event{ .trace_id = trace_id, .ts_ns = static_cast<uint64_t>(ts), .endpoint = endpoint, .stage = stage });
+}
+
+std::string export_chrome_trace() {
+    std::vector<std::pair<uint32_t, Event>> events;
+    {
+        auto registered = rings().get();
+        for (auto& ring : *registered) {
+            ring->read(events);
+        }
+    }
+    std::sort(events.begin(), events.end(), [] (auto& a, auto& b) { return a.second.ts_ns < b.second.ts_ns; });
+
+    std::stringstream out;
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    auto write_event = [&] (const char* name, char phase, uint32_t tid, const Event& event) {
+        out << (first ? "" : ",")
+            << "{\"name\":\"" << name << "\""
+            << ",\"cat\":\"bus\""
+            << ",\"ph\":\"" << phase << "\""
+            << ",\"id\":" << event.trace_id
+            << ",\"ts\":" << event.ts_ns / 1000 << "." << event.ts_ns % 1000 / 100 << event.ts_ns % 100 / 10 << event.ts_ns % 10
+            << ",\"pid\":0"
+            << ",\"tid\":" << tid
+            << ",\"args\":{\"endpoint\":" << event.endpoint << "}}";
+        first = false;
+    };
+    for (auto& [tid, event] : events) {
+        char phase = stage_phase(event.stage);
+        if (phase == 'b') {
+            write_event(flow_name(event.stage), phase, tid, event);
+        }
+        write_event(stage_name(event.stage), 'n', tid, event);
+        if (phase == 'e') {
+            write_event(flow_name(event.stage), phase, tid, event);
+        }
+    }
+    out << "]}";
+    return out.str();
+}
+
+}
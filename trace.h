@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+
+// sampled message lifecycle tracing, process wide.
+// Events go to per-thread rings and are merged on export.
+namespace bus::trace {
+
+enum class Stage : uint8_t {
+    // egress, traced from TcpBus::send till the frame is written
+    Enqueue,
+    Dequeue,
+    WriteDone,
+
+    // ingress, traced from frame completion till the response is queued
+    ReadDone,
+    HandlerStart,
+    HandlerDone,
+    ResponseEnqueue,
+};
+
+// trace one of sample_every messages on average, 0 disables tracing
+void enable(size_t sample_every);
+void disable();
+
+// returns nonzero trace id if a new message should be traced
+uint64_t sample();
+
+void record_event(uint64_t trace_id, Stage stage, int endpoint);
+
+inline void record(uint64_t trace_id, Stage stage, int endpoint) {
+    if (trace_id) {
+        record_event(trace_id, stage, endpoint);
+    }
+}
+
+// chrome://tracing or perfetto json
+std::string export_chrome_trace();
+
+}
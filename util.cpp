@@ -1,20 +1,91 @@
 #include "util.h"
 
+#include "checksum.h"
+#include "error.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 namespace bus::internal {
 
-void write_header(size_t size, char* buf) {
+namespace {
+
+constexpr uint64_t kChecksumFlag = 1ull << 31;
+
+uint64_t read_raw_header(char* buf) {
+    uint64_t result = 0;
+    for (ssize_t i = header_len - 1; i >= 0; --i) {
+        result = result * 256 + static_cast<unsigned char>(buf[i]);
+    }
+    return result;
+}
+
+}
+
+void write_header(size_t size, char* buf, std::optional<uint32_t> checksum) {
+    uint64_t value = size;
+    if (checksum) {
+        if (size >= kChecksumFlag) {
+            throw BusError("too big message for checksum");
+        }
+        value |= kChecksumFlag | static_cast<uint64_t>(*checksum) << 32;
+    }
     for (size_t i = 0; i < header_len; ++i) {
-        buf[i] = size & 255;
-        size /= 256;
+        buf[i] = value & 255;
+        value /= 256;
     }
 }
 
 size_t read_header(char* buf) {
-    size_t result = 0;
-    for (ssize_t i = header_len - 1; i >= 0; --i) {
-        result = result * 256 + static_cast<unsigned char>(buf[i]);
+    uint64_t value = read_raw_header(buf);
+    return value & kChecksumFlag ? value & (kChecksumFlag - 1) : value;
+}
+
+std::optional<uint32_t> read_checksum(char* buf) {
+    uint64_t value = read_raw_header(buf);
+    if (!(value & kChecksumFlag)) {
+        return std::nullopt;
     }
-    return result;
+    return value >> 32;
+}
+
+uint32_t frame_checksum(const char* data, size_t size) {
+    uint64_t lower = size | kChecksumFlag;
+    char header[4];
+    for (size_t i = 0; i < sizeof(header); ++i) {
+        header[i] = lower & 255;
+        lower /= 256;
+    }
+    return crc32c(data, size, crc32c(header, sizeof(header)));
+}
+
+void pin_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    CHECK_ERRNO(sched_setaffinity(0, sizeof(set), &set) == 0);
+}
+
+void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, std::optional<std::chrono::nanoseconds> timeout) {
+    static_assert(sizeof(word) == sizeof(uint32_t));
+    timespec ts;
+    if (timeout) {
+        auto ns = std::max(timeout->count(), std::chrono::nanoseconds::rep(0));
+        ts.tv_sec = ns / 1'000'000'000;
+        ts.tv_nsec = ns % 1'000'000'000;
+    }
+    // relative timeout is measured on monotonic clock
+    if (syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, expected, timeout ? &ts : nullptr, nullptr, 0) != 0) {
+        CHECK_ERRNO(errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT);
+    }
+}
+
+void futex_wake(std::atomic<uint32_t>& word) {
+    CHECK_ERRNO(syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0) >= 0);
 }
 
 }
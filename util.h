@@ -4,14 +4,40 @@
 #include <mutex>
 #include <atomic>
 #include <optional>
+#include <chrono>
 #include <functional>
+#include <stdint.h>
 
 namespace bus::internal {
 
 constexpr size_t header_len = 8;
 
-void write_header(size_t size, char* buf);
+// little endian payload size. Frame with checksum has bit 31 set, size in lower bits
+// and frame_checksum in the upper half, so plain headers are unchanged
+void write_header(size_t size, char* buf, std::optional<uint32_t> checksum = std::nullopt);
 
 size_t read_header(char* buf);
 
+std::optional<uint32_t> read_checksum(char* buf);
+
+// crc32c of the lower half of header (size with checksum flag) and then of payload,
+// so corrupted size or flag doesn't pass either
+uint32_t frame_checksum(const char* data, size_t size);
+
+// binds calling thread to cpu
+void pin_thread(int cpu);
+
+// hint for spin-wait loops
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// sleeps while word holds expected, until woken or timeout passes. Spurious returns are possible
+void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, std::optional<std::chrono::nanoseconds> timeout = std::nullopt);
+
+// wakes all threads sleeping on word
+void futex_wake(std::atomic<uint32_t>& word);
+
 }